@@ -6,7 +6,16 @@
 #include <linux/vmalloc.h>
 #include <linux/uaccess.h>
 #include <linux/jiffies.h>
-#include<linux/semaphore.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include "clipboard.h"
 
 
 MODULE_LICENSE("GPL");
@@ -26,19 +35,275 @@ static dev_t start;
 static struct cdev* chardev = NULL;
 static struct class* class = NULL;
 static struct device* device = NULL;
-static char *clipboard;  // Space for the "clipboard"
+
+/*
+ * A version of the clipboard. Versions are never modified once published:
+ * writers build a new one and swap the clipboard pointer (RCU), so readers
+ * just take a reference and copy it to user space without any lock.
+ */
+struct clipboard_buf {
+	struct kref ref;
+	struct rcu_head rcu;
+	u64 gen;	/* Generation (number of updates) it belongs to */
+	u64 ts;		/* When it was written (CLOCK_REALTIME, ns) */
+	size_t len;
+	char data[];
+};
+
+static struct clipboard_buf __rcu *clipboard;  // Current "clipboard"
+static DEFINE_MUTEX(clipboard_mtx);  /* Serializes writers and protects the history */
+
+/*
+ * History: a ring with a reference to the last versions, the current one
+ * included, bounded both in versions and in memory (but the current one
+ * is always kept)
+ */
+static unsigned int history_len = 16;
+module_param(history_len, uint, 0444);
+MODULE_PARM_DESC(history_len, "Number of clipboard versions kept");
+
+static unsigned int history_kb = 256;
+module_param(history_kb, uint, 0444);
+MODULE_PARM_DESC(history_kb, "Memory for the clipboard versions kept (KiB)");
+
+static struct clipboard_buf **history;
+static unsigned int hist_first;	/* Oldest version in the ring */
+static unsigned int hist_count;
+static size_t hist_bytes;
 
 /* Workqueue descriptor */
-struct semaphore cola, mtx;
+static DECLARE_WAIT_QUEUE_HEAD(clipboard_wq);
 
 /* Timestamp  (tick resolution) to keep track of last time the clipboard was updated */
 static unsigned long last_clipboard_update = 0;
-static int cont = 0;
+
+/* Number of updates so far: readers wait until it changes */
+static atomic64_t generation = ATOMIC64_INIT(0);
+
+/* Per open file state */
+struct clipboard_file {
+	u64 seen;	/* Generation returned by the last read */
+	bool read_now;	/* Do not wait for a newer generation */
+};
+
+static struct clipboard_buf *clipboard_buf_alloc(size_t len) {
+	struct clipboard_buf *cb;
+
+	if ((cb = vmalloc(sizeof(*cb) + len + 1)) == NULL)
+		return NULL;
+	kref_init(&cb->ref);
+	cb->len = len;
+	cb->data[len] = '\0';
+
+	return cb;
+}
+
+static void clipboard_buf_free_rcu(struct rcu_head *rcu) {
+	vfree(container_of(rcu, struct clipboard_buf, rcu));
+}
+
+/* Readers may still be taking a reference from within an RCU section */
+static void clipboard_buf_release(struct kref *ref) {
+	call_rcu(&container_of(ref, struct clipboard_buf, ref)->rcu, clipboard_buf_free_rcu);
+}
+
+static void clipboard_buf_put(struct clipboard_buf *cb) {
+	kref_put(&cb->ref, clipboard_buf_release);
+}
+
+/* Take a reference to the current version */
+static struct clipboard_buf *clipboard_get(void) {
+	struct clipboard_buf *cb;
+
+	rcu_read_lock();
+	/* A version just replaced may be on its way out: retry with the new one */
+	do {
+		cb = rcu_dereference(clipboard);
+	} while (!kref_get_unless_zero(&cb->ref));
+	rcu_read_unlock();
+
+	return cb;
+}
+
+/* i-th oldest version in the history (clipboard_mtx held) */
+static struct clipboard_buf *history_at(unsigned int i) {
+	return history[(hist_first + i) % history_len];
+}
+
+static void history_drop_oldest(void) {
+	struct clipboard_buf *oldest = history[hist_first];
+
+	hist_first = (hist_first + 1) % history_len;
+	hist_count--;
+	hist_bytes -= oldest->len;
+	clipboard_buf_put(oldest);
+}
+
+/*
+ * Add cb to the history (clipboard_mtx held) and drop the oldest versions
+ * out of bounds
+ */
+static void history_push(struct clipboard_buf *cb) {
+	kref_get(&cb->ref);
+	if (hist_count == history_len)
+		history_drop_oldest();
+	history[(hist_first + hist_count) % history_len] = cb;
+	hist_count++;
+	hist_bytes += cb->len;
+
+	while (hist_count > 1 && hist_bytes > (size_t)history_kb * 1024)
+		history_drop_oldest();
+}
+
+static void history_clear(void) {
+	while (hist_count > 0)
+		history_drop_oldest();
+}
+
+/* Publish cb as the current version */
+static void clipboard_publish(struct clipboard_buf *cb) {
+	struct clipboard_buf *old;
+
+	cb->ts = ktime_get_real_ns();
+
+	mutex_lock(&clipboard_mtx);
+	old = rcu_dereference_protected(clipboard, lockdep_is_held(&clipboard_mtx));
+	cb->gen = old->gen + 1;
+	history_push(cb);
+	rcu_assign_pointer(clipboard, cb);
+	atomic64_set(&generation, cb->gen);
+	mutex_unlock(&clipboard_mtx);
+
+	clipboard_buf_put(old);
+}
+
+/*
+ * Take a reference to the versions of the history newer than gen (at most
+ * max), oldest first. Returns how many were taken and the oldest one kept.
+ */
+static unsigned int history_get(u64 gen, struct clipboard_buf **cbs, unsigned int max,
+				u64 *oldest) {
+	unsigned int i, n = 0;
+	struct clipboard_buf *cb;
+
+	mutex_lock(&clipboard_mtx);
+	*oldest = history_at(0)->gen;
+	for (i = 0; i < hist_count && n < max; i++) {
+		cb = history_at(i);
+		if (cb->gen > gen) {
+			kref_get(&cb->ref);
+			cbs[n++] = cb;
+		}
+	}
+	mutex_unlock(&clipboard_mtx);
+
+	return n;
+}
+
+static long clipboard_get_version(struct clipboard_version __user *uarg) {
+	struct clipboard_version v;
+	struct clipboard_buf *cb;
+	u64 oldest;
+	long ret = 0;
+
+	if (copy_from_user(&v, uarg, sizeof(v)))
+		return -EFAULT;
+
+	/* Versions are in order, so the first one newer than gen - 1 is gen */
+	if (v.gen == 0 || history_get(v.gen - 1, &cb, 1, &oldest) == 0)
+		return -ENOENT;
+	if (cb->gen != v.gen) {
+		ret = -ENOENT;
+		goto out;
+	}
+	if (v.size < cb->len) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	if (copy_to_user((void __user *)(uintptr_t)v.buf, cb->data, cb->len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	v.ts_ns = cb->ts;
+	v.len = cb->len;
+	if (copy_to_user(uarg, &v, sizeof(v)))
+		ret = -EFAULT;
+out:
+	clipboard_buf_put(cb);
+	return ret;
+}
+
+static long clipboard_get_since(struct clipboard_since __user *uarg) {
+	struct clipboard_since s;
+	struct clipboard_buf **cbs;
+	struct clipboard_rec rec = { 0 };
+	char __user *ubuf;
+	unsigned int i, n, copied = 0;
+	size_t used = 0, rec_size;
+	long ret = 0;
+
+	if (copy_from_user(&s, uarg, sizeof(s)))
+		return -EFAULT;
+	ubuf = (char __user *)(uintptr_t)s.buf;
+
+	if ((cbs = kmalloc_array(history_len, sizeof(*cbs), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	n = history_get(s.gen, cbs, history_len, &s.oldest);
+
+	for (i = 0; i < n; i++) {
+		rec_size = sizeof(rec) + ALIGN(cbs[i]->len, 8);
+		if (used + rec_size > s.size)
+			break;
+		rec.gen = cbs[i]->gen;
+		rec.ts_ns = cbs[i]->ts;
+		rec.len = cbs[i]->len;
+		if (copy_to_user(ubuf + used, &rec, sizeof(rec)) ||
+		    copy_to_user(ubuf + used + sizeof(rec), cbs[i]->data, cbs[i]->len)) {
+			ret = -EFAULT;
+			goto out;
+		}
+		used += rec_size;
+		copied++;
+	}
+
+	/* Not even the first one fits */
+	if (copied == 0 && n > 0) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	s.len = used;
+	if (copy_to_user(uarg, &s, sizeof(s)))
+		ret = -EFAULT;
+	else
+		ret = copied;
+out:
+	for (i = 0; i < n; i++)
+		clipboard_buf_put(cbs[i]);
+	kfree(cbs);
+	return ret;
+}
+
+static int clipboard_open(struct inode *inode, struct file *filp) {
+	struct clipboard_file *cf;
+
+	if ((cf = kzalloc(sizeof(*cf), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	filp->private_data = cf;
+
+	return 0;
+}
+
+static int clipboard_release(struct inode *inode, struct file *filp) {
+	kfree(filp->private_data);
+	return 0;
+}
 
 
 static ssize_t clipboard_write(struct file *filp, const char __user *buf, size_t len, loff_t *off) {
   	int available_space = BUFFER_LENGTH - 1;
-	int i;
+	struct clipboard_buf *cb;
 
   	if ((*off) > 0) /* The application can write in this entry just once !! */
     		return 0;
@@ -48,55 +313,46 @@ static ssize_t clipboard_write(struct file *filp, const char __user *buf, size_t
     		return -ENOSPC;
   	}
 
-  	/* Transfer data from user to kernel space */
-  	if (copy_from_user( &clipboard[0], buf, len ))
+  	if ((cb = clipboard_buf_alloc(len)) == NULL)
+		return -ENOMEM;
+
+  	/* Transfer data from user to kernel space (the new version is private yet) */
+  	if (copy_from_user(cb->data, buf, len)) {
+		clipboard_buf_put(cb);
     		return -EFAULT;
+	}
 
-  	clipboard[len] = '\0'; /* Add the `\0' */
   	*off += len;          /* Update the file position indicator */
 
-
   /* Register timestamp */
   last_clipboard_update = jiffies;
 
   /* Wakeup all processes waiting for update */
-	if (down_interruptible(&mtx)){
-		up(&mtx);
-		pr_info("Blocking operation interrupted due to signal\n");
-		module_put(THIS_MODULE);
-		return -EINTR;
-	}
-  	for(i = 0; i < cont; i++){
-		up(&cola);
-	}
-	cont = 0;
-	up(&mtx);
+  clipboard_publish(cb);
+  wake_up_all(&clipboard_wq);
 
   return len;
 }
 
 static ssize_t clipboard_read(struct file *filp, char __user *buf, size_t len, loff_t *off) {
 
+	struct clipboard_file *cf = filp->private_data;
+	struct clipboard_buf *cb;
 	int nr_bytes;
-	unsigned long last_update_local;
 
-	if ((*off) > 0) /* Tell the application that there is nothing left to read */
+	/*
+	 * Tell the application that there is nothing left to read, unless the
+	 * clipboard changed since (so that the descriptor can be polled again)
+	 */
+	if ((*off) > 0 && atomic64_read(&generation) == cf->seen)
 	    	return 0;
 
 	/* Increment this module's reference counter */
 	try_module_get(THIS_MODULE);
 
-	/* Wait until next clipboard update */
-	last_update_local = last_clipboard_update;
-	if (down_interruptible(&mtx)){
-		up(&mtx);
-		pr_info("Blocking operation interrupted due to signal\n");
-		module_put(THIS_MODULE);
-		return -EINTR;
-	}
-	cont++;
-	up(&mtx);
-  	if (down_interruptible(&cola)) {
+	/* Wait until the clipboard changes since the last read */
+  	if (!cf->read_now &&
+	    wait_event_interruptible(clipboard_wq, atomic64_read(&generation) != cf->seen)) {
     		pr_info("Blocking operation interrupted due to signal\n");
     		module_put(THIS_MODULE);
     		return -EINTR;
@@ -105,23 +361,65 @@ static ssize_t clipboard_read(struct file *filp, char __user *buf, size_t len, l
 	/* Decrement this module's reference counter */
 	module_put(THIS_MODULE);
 
-	nr_bytes = strlen(clipboard);
+	cb = clipboard_get();
+	nr_bytes = cb->len;
 
-	if (len < nr_bytes)
-		return -ENOSPC;
+	if (len < nr_bytes) {
+		nr_bytes = -ENOSPC;
+		goto out;
+	}
 
 	/* Transfer data from the kernel to userspace */
-	if (copy_to_user(buf, clipboard, nr_bytes))
-		return -EINVAL;
+	if (copy_to_user(buf, cb->data, nr_bytes)) {
+		nr_bytes = -EINVAL;
+		goto out;
+	}
 
+	cf->seen = cb->gen;
 	(*off) += len; /* Update the file pointer */
-
+out:
+	clipboard_buf_put(cb);
 	return nr_bytes;
 }
 
+/* Readable once the clipboard changes since the last read on filp */
+static unsigned int clipboard_poll(struct file *filp, poll_table *wait) {
+	struct clipboard_file *cf = filp->private_data;
+
+	poll_wait(filp, &clipboard_wq, wait);
+	if (atomic64_read(&generation) != cf->seen)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static long clipboard_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	struct clipboard_file *cf = filp->private_data;
+	int val;
+
+	switch (cmd) {
+	case CLIPBOARD_SET_READ_NOW:
+		if (get_user(val, (int __user *)arg))
+			return -EFAULT;
+		cf->read_now = (val != 0);
+		return 0;
+	case CLIPBOARD_GET_GENERATION:
+		return put_user((u64)atomic64_read(&generation), (u64 __user *)arg);
+	case CLIPBOARD_GET_VERSION:
+		return clipboard_get_version((struct clipboard_version __user *)arg);
+	case CLIPBOARD_GET_SINCE:
+		return clipboard_get_since((struct clipboard_since __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 static struct file_operations fops = {
   .read = clipboard_read,
   .write = clipboard_write,
+  .open = clipboard_open,
+  .release = clipboard_release,
+  .unlocked_ioctl = clipboard_ioctl,
+  .poll = clipboard_poll,
 };
 
 
@@ -139,19 +437,28 @@ int init_clipboard_module( void )
   int major;    /* Major number assigned to our device driver */
   int minor;    /* Minor number assigned to the associated character device */
   int ret;
+  struct clipboard_buf *cb;
+
+  if (history_len == 0)
+    history_len = 1;
+
+  history = kcalloc(history_len, sizeof(*history), GFP_KERNEL);
 
-  clipboard = (char *)vmalloc( BUFFER_LENGTH );
+  /* Initial (empty) version */
+  cb = clipboard_buf_alloc(0);
 
-  if (!clipboard) {
+  if (!history || !cb) {
     printk(KERN_INFO "Can't allocate clipboard memory");
+    kfree(history);
+    if (cb)
+      vfree(cb);
     return  -ENOMEM;
   }
 
-  memset( clipboard, 0, BUFFER_LENGTH );
-
-  /* Init wait queue */
-  	sema_init(&cola,0);
-	sema_init(&mtx, 1);
+  cb->gen = 0;
+  cb->ts = ktime_get_real_ns();
+  history_push(cb);
+  RCU_INIT_POINTER(clipboard, cb);
 
   /* Get available (major,minor) range */
   if ((ret = alloc_chrdev_region (&start, 0, 1, DEVICE_NAME))) {
@@ -220,7 +527,11 @@ error_add:
 error_alloc:
   unregister_chrdev_region(start, 1);
 error_alloc_region:
-  vfree(clipboard);
+  RCU_INIT_POINTER(clipboard, NULL);
+  history_clear();
+  clipboard_buf_put(cb);
+  kfree(history);
+  rcu_barrier();
 
   return ret;
 }
@@ -243,7 +554,14 @@ void exit_clipboard_module( void )
    */
   unregister_chrdev_region(start, 1);
 
-  vfree(clipboard);
+  /* No readers or writers left: drop the current version */
+  clipboard_buf_put(rcu_dereference_protected(clipboard, 1));
+  RCU_INIT_POINTER(clipboard, NULL);
+  history_clear();
+  kfree(history);
+
+  /* Wait for the versions still pending to be freed */
+  rcu_barrier();
 
   printk(KERN_INFO "Clipboard-update: Module unloaded.\n");
 }
@@ -0,0 +1,67 @@
+/*
+ * Interface of the clipboard_update device shared by the kernel module
+ * and the user programs (ioctl numbers).
+ */
+#ifndef CLIPBOARD_H
+#define CLIPBOARD_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define CLIPBOARD_IOC_MAGIC 'c'
+
+/*
+ * Reads wait until the clipboard changes after the last read on the same
+ * descriptor (a fresh descriptor has seen nothing yet). In read-now mode
+ * (arg != 0) they return the current contents right away instead.
+ */
+#define CLIPBOARD_SET_READ_NOW	_IOW(CLIPBOARD_IOC_MAGIC, 1, int)
+
+/* Number of updates of the clipboard so far */
+#define CLIPBOARD_GET_GENERATION	_IOR(CLIPBOARD_IOC_MAGIC, 2, __u64)
+
+/*
+ * The module keeps the last versions of the clipboard (history_len= and
+ * history_kb= parameters), each one with its generation and the time it
+ * was written (CLOCK_REALTIME, ns).
+ *
+ * CLIPBOARD_GET_VERSION copies version gen into buf (size bytes) and fills
+ * in len and ts_ns. It fails with ENOENT if the version is no longer kept
+ * (or does not exist yet) and with ENOSPC if buf is too small.
+ */
+struct clipboard_version {
+	__u64 gen;
+	__u64 ts_ns;	/* out */
+	__u64 buf;	/* User pointer */
+	__u32 size;
+	__u32 len;	/* out */
+};
+
+#define CLIPBOARD_GET_VERSION	_IOWR(CLIPBOARD_IOC_MAGIC, 3, struct clipboard_version)
+
+/*
+ * CLIPBOARD_GET_SINCE copies the versions newer than gen, oldest first, to
+ * buf as a sequence of struct clipboard_rec, each one followed by its data
+ * padded to 8 bytes. It returns the number of versions copied: as many as
+ * fit in size bytes, so call it again from the last gen to get the rest.
+ * oldest tells the first version kept: if it is greater than gen + 1 the
+ * versions in between were lost.
+ */
+struct clipboard_since {
+	__u64 gen;
+	__u64 oldest;	/* out */
+	__u64 buf;	/* User pointer */
+	__u32 size;
+	__u32 len;	/* out: bytes used in buf */
+};
+
+struct clipboard_rec {
+	__u64 gen;
+	__u64 ts_ns;
+	__u32 len;
+	__u32 pad;
+};
+
+#define CLIPBOARD_GET_SINCE	_IOWR(CLIPBOARD_IOC_MAGIC, 4, struct clipboard_since)
+
+#endif
@@ -6,6 +6,8 @@
 #include<linux/slab.h>
 #include<linux/semaphore.h>
 #include<linux/kfifo.h>
+#include<linux/mutex.h>
+#include<linux/ioctl.h>
 
 MODULE_DESCRIPTION("ChardevMisc Kernel Module - FDI-UCM");
 MODULE_AUTHOR("Juan Carlos Saez");
@@ -20,12 +22,30 @@ static int device_open(struct inode *, struct file *);
 static int device_release(struct inode *, struct file *);
 static ssize_t device_read(struct file *, char *, size_t, loff_t *);
 static ssize_t device_write(struct file *, const char *, size_t, loff_t *);
+static long device_ioctl(struct file *, unsigned int, unsigned long);
 
 #define SUCCESS 0
 #define DEVICE_NAME "prodcons"  /* Dev name as it appears in /proc/devices   */
 #define CLASS_NAME "cool"
 #define BUF_LEN 80      /* Max length of the message from the device */
 #define MAX_ITEMS_CBUF 4
+#define MAX_CAPACITY (1 << 18)	/* Upper bound for capacity (items) */
+
+/* Same number as in PracticaFinal/ParteB/prodcons.h */
+#define PRODCONS_SET_CAPACITY _IOW('p', 3, unsigned int)
+
+/* Number of items of cbuf (rounded up to a power of two) */
+static unsigned int capacity = MAX_ITEMS_CBUF;
+module_param(capacity, uint, 0444);
+MODULE_PARM_DESC(capacity, "Capacity of the queue in items");
+
+/* Max number of items ever queued */
+static unsigned int high_water = 0;
+module_param(high_water, uint, 0444);
+MODULE_PARM_DESC(high_water, "Max number of items queued so far (read only)");
+
+/* Serializes resizes */
+static DEFINE_MUTEX(resize_mtx);
 
 struct kfifo cbuf;
 struct semaphore elementos,huecos, mtx;
@@ -34,7 +54,8 @@ static struct file_operations fops = {
     .read = device_read,
     .write = device_write,
     .open = device_open,
-    .release = device_release
+    .release = device_release,
+    .unlocked_ioctl = device_ioctl
 };
 
 
@@ -57,11 +78,15 @@ int init_module(void)
     int ret;
     struct device *device;
 
-	if (kfifo_alloc(&cbuf,MAX_ITEMS_CBUF*sizeof(int),GFP_KERNEL))
+	if (capacity == 0 || capacity > MAX_CAPACITY)
+		return -EINVAL;
+	if (kfifo_alloc(&cbuf,capacity*sizeof(int),GFP_KERNEL))
 		return -ENOMEM;
 
 	sema_init(&elementos,0);
-	sema_init(&huecos,MAX_ITEMS_CBUF);
+	/* kfifo_alloc() rounds the size up to a power of 2 */
+	capacity = kfifo_size(&cbuf)/sizeof(int);
+	sema_init(&huecos,capacity);
 	sema_init(&mtx, 1);
 
     ret = misc_register(&misc_prodcons);
@@ -197,8 +222,76 @@ device_write(struct file *filp, const char *buff, size_t len, loff_t * off)
 	}
 
 	kfifo_in(&cbuf,&val,sizeof(int));
+	if (kfifo_len(&cbuf)/sizeof(int) > high_water)
+		high_water = kfifo_len(&cbuf)/sizeof(int);
 	up(&mtx);
 	up(&elementos);
 
 	return len;
 }
+
+/*
+ * Move the contents of cbuf to a new kfifo of (at least) n items. The
+ * slots that go away are taken from huecos first, as a producer would
+ * do, so that the producers already past down(&huecos) still fit;
+ * if they are not free right now, -EBUSY.
+ */
+static int cbuf_resize(unsigned int n)
+{
+	struct kfifo nbuf;
+	unsigned int old_slots, new_slots, i;
+	int val;
+
+	if (n == 0 || n > MAX_CAPACITY)
+		return -EINVAL;
+	if (kfifo_alloc(&nbuf,n*sizeof(int),GFP_KERNEL))
+		return -ENOMEM;
+	new_slots = kfifo_size(&nbuf)/sizeof(int);
+
+	mutex_lock(&resize_mtx);
+	old_slots = kfifo_size(&cbuf)/sizeof(int);
+	for (i = new_slots; i < old_slots; i++) {
+		if (down_trylock(&huecos)) {
+			for (; i > new_slots; i--)
+				up(&huecos);
+			mutex_unlock(&resize_mtx);
+			kfifo_free(&nbuf);
+			return -EBUSY;
+		}
+	}
+	if (down_interruptible(&mtx)) {
+		for (; i > new_slots; i--)
+			up(&huecos);
+		mutex_unlock(&resize_mtx);
+		kfifo_free(&nbuf);
+		return -EINTR;
+	}
+
+	while (kfifo_out(&cbuf,&val,sizeof(int)) == sizeof(int))
+		kfifo_in(&nbuf,&val,sizeof(int));
+	swap(cbuf, nbuf);
+	capacity = new_slots;
+	up(&mtx);
+
+	/* New slots for the producers */
+	for (i = old_slots; i < new_slots; i++)
+		up(&huecos);
+	mutex_unlock(&resize_mtx);
+
+	kfifo_free(&nbuf);
+	return 0;
+}
+
+static long device_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	unsigned int n;
+
+	switch (cmd) {
+	case PRODCONS_SET_CAPACITY:
+		if (get_user(n, (unsigned int __user *)arg))
+			return -EFAULT;
+		return cbuf_resize(n);
+	default:
+		return -ENOTTY;
+	}
+}
@@ -3,9 +3,30 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>  /* for copy_to_user */
 #include<linux/slab.h>
-#include<linux/semaphore.h>
+#include<linux/spinlock.h>
+#include<linux/wait.h>
+#include<linux/jiffies.h>
 #include<linux/kfifo.h>
+#include<linux/ctype.h>
+#include<linux/poll.h>
+#include<linux/vmalloc.h>
+#include<linux/mm.h>
+#include<linux/log2.h>
+#include<linux/percpu.h>
+#include<linux/atomic.h>
+#include<linux/bitops.h>
+#include<linux/version.h>
+#include<linux/list.h>
+#include<linux/timekeeping.h>
+#include<linux/device.h>
+#include<linux/uio.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include<linux/sched/signal.h>
+#else
+#include<linux/sched.h>
+#endif
 #include <linux/cdev.h>
+#include "prodcons.h"
 
 MODULE_DESCRIPTION("ProdCons Kernel Module - FDI-UCM");
 MODULE_AUTHOR("Juan Carlos Saez");
@@ -18,28 +39,612 @@ int init_module(void);
 void cleanup_module(void);
 static int device_open(struct inode *, struct file *);
 static int device_release(struct inode *, struct file *);
-static ssize_t device_read(struct file *, char *, size_t, loff_t *);
-static ssize_t device_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t device_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t device_write_iter(struct kiocb *, struct iov_iter *);
+static long device_ioctl(struct file *, unsigned int, unsigned long);
+static unsigned int device_poll(struct file *, poll_table *);
+static int device_mmap(struct file *, struct vm_area_struct *);
 
 #define SUCCESS 0
 #define DEVICE_NAME "prodcons"  /* Dev name as it appears in /proc/devices   */
-#define CLASS_NAME "cool"
+#define CLASS_NAME "prodcons"
 #define BUF_LEN 80      /* Max length of the message from the device */
 #define MAX_ITEMS_CBUF 5
+/* Upper bound for capacity (items): 1 MiB fifos, kmalloc()ed in one piece */
+#define MAX_CAPACITY (1 << 16)
+#define MAX_RING_SLOTS (1 << 18)	/* s32 slots in vmalloc_user() memory */
+#define RING_SLOTS 4096
+#define MSG_BYTES 65536
+#define MAX_MSG_LEN 65535	/* Limit of the 2-byte record header */
+#define MAX_CHUNK PAGE_SIZE	/* Max bytes parsed/formatted per read or write */
+#define MAX_ITEM_LEN 12	/* strlen("-2147483648\n") */
+#define DEFAULT_PRIO (PRODCONS_NR_PRIOS - 1)	/* Items written without priority */
 
-struct kfifo cbuf;
-struct semaphore elementos,huecos, mtx;
+/* What a writer does when the queue is full */
+#define OVERFLOW_BLOCK		0	/* Sleep until there is room */
+#define OVERFLOW_DROP_NEWEST	1	/* Discard the new items */
+#define OVERFLOW_DROP_OLDEST	2	/* Discard queued items to make room */
+#define OVERFLOW_FAIL_FAST	3	/* Fail with ENOBUFS */
 
+/* Queued integer and the time it was enqueued (ktime_get_ns()) */
+struct prodcons_item {
+	int val;
+	u64 ts;
+};
+
+/* kfifo of items with a name, so that it can be passed around */
+struct item_kfifo __STRUCT_KFIFO_PTR(struct prodcons_item, 0, struct prodcons_item);
+
+#define DWELL_BUCKETS 40
+
+/*
+ * Statistics of a queue, kept per CPU so that producers and consumers do
+ * not share cache lines; sysfs adds them up. Blocks are sleeps: a task
+ * waiting for a watermark above 1 for longer than wake_timeout_ms counts
+ * more than once.
+ * dwell[b] counts the items that waited at least 2^(b-1) ns and less than
+ * 2^b ns in the queue (the last bucket, anything longer).
+ */
+struct prodcons_stats {
+	unsigned long enqueued;
+	unsigned long dequeued;
+	unsigned long producer_blocks;
+	unsigned long consumer_blocks;
+	u64 blocked_ns;
+	unsigned long eintr;	/* Sleeps interrupted by a signal */
+	unsigned long parse_rejects;	/* Writes refused for invalid items */
+	unsigned long dwell[DWELL_BUCKETS];
+};
+
+/* Sub-queue of a CPU in PRODCONS_MODE_PERCPU */
+struct prodcons_subq {
+	spinlock_t lock;
+	struct item_kfifo fifo;
+};
+
+/*
+ * State of each queue (one per minor). The shared ring for mmap is
+ * described by struct prodcons_ring in prodcons.h: its contents are moved
+ * by user space, the kernel only blocks and wakes up tasks. ring_mask is
+ * a private copy, since the header is writable by user space.
+ */
+struct prodcons_queue {
+	int mode;	/* PRODCONS_MODE_*, fixed when the module is loaded */
+	int overflow;	/* OVERFLOW_*, fixed when the module is loaded */
+	atomic_long_t dropped;	/* Items discarded by the overflow policy */
+	struct item_kfifo cbuf;	/* PRODCONS_MODE_FIFO */
+	spinlock_t lock;	/* Protects cbuf and high_water */
+	unsigned int high_water;	/* Max number of items ever queued */
+
+	/*
+	 * PRODCONS_MODE_PERCPU: producers fill their CPU's sub-queue and
+	 * consumers drain theirs before stealing from the others. The
+	 * counter is raised before inserting and lowered after removing, so
+	 * it never underflows.
+	 */
+	struct prodcons_subq __percpu *pcpu;
+	atomic_t pcpu_items;
+	unsigned int pcpu_size;	/* Capacity of all the sub-queues together */
+
+	/*
+	 * PRODCONS_MODE_PRIO: one kfifo per level, each one able to hold the
+	 * whole capacity, and a bitmap of the non-empty levels so that the
+	 * most urgent one is found with a single __ffs(). Protected by lock.
+	 */
+	struct item_kfifo prio[PRODCONS_NR_PRIOS];
+	unsigned long prio_map;
+	unsigned int prio_items;
+	unsigned int prio_size;
+
+	/*
+	 * PRODCONS_MODE_MSG: length-prefixed byte records. Capacity is in
+	 * bytes; msg_count (messages queued) drives the consumer side.
+	 * Protected by lock.
+	 */
+	struct kfifo_rec_ptr_2 msgs;
+	unsigned int msg_count;
+	unsigned int msg_max;	/* Longest message that fits */
+
+	/*
+	 * PRODCONS_MODE_BCAST: one ring shared by all the readers, each one
+	 * with its own cursor (struct prodcons_reader). Sequence numbers wrap
+	 * around, only their differences are meaningful. bcast_tail is the
+	 * cursor of the slowest reader (bcast_head without readers): slots
+	 * are only reused once every reader went past them. Protected by lock.
+	 */
+	struct prodcons_item *bcast;
+	unsigned int bcast_mask;
+	unsigned long bcast_head;	/* Sequence number of the next item */
+	unsigned long bcast_tail;
+	struct list_head readers;
+
+	wait_queue_head_t consumers;	/* Readers waiting for items */
+	wait_queue_head_t producers;	/* Writers waiting for free slots */
+
+	/* Fair queues: tasks waiting for their turn (struct fair_waiter) */
+	bool fair;
+	struct list_head fair_readers;
+	struct list_head fair_writers;
+
+	struct prodcons_ring *ring;
+	u32 ring_mask;
+	spinlock_t ring_lock;	/* Serializes updates of ring->flags */
+	wait_queue_head_t ring_consumers;
+	wait_queue_head_t ring_producers;
+
+	struct prodcons_stats __percpu *stats;
+
+	/*
+	 * Adaptive spinning before sleeping: spin_ns is the current budget,
+	 * between spin_max_ns / 16 and spin_max_ns (0 = never spin).
+	 */
+	unsigned int spin_ns;
+	unsigned int spin_max_ns;
+
+	int node;	/* NUMA node holding this queue */
+	struct device *device;
+};
+
+#define MAX_QUEUES 64
+
+static unsigned int nr_queues = 1;
+module_param(nr_queues, uint, 0444);
+MODULE_PARM_DESC(nr_queues, "Number of queues (/dev/prodcons0..N-1)");
+
+static int numa_nodes[MAX_QUEUES];
+static int nr_numa_nodes;
+module_param_array(numa_nodes, int, &nr_numa_nodes, 0444);
+MODULE_PARM_DESC(numa_nodes, "NUMA node of each queue (default: node loading the module)");
+
+static const char * const mode_names[] = {
+	[PRODCONS_MODE_FIFO] = "fifo",
+	[PRODCONS_MODE_PERCPU] = "percpu",
+	[PRODCONS_MODE_PRIO] = "prio",
+	[PRODCONS_MODE_MSG] = "msg",
+	[PRODCONS_MODE_BCAST] = "bcast",
+};
+
+static char *modes[MAX_QUEUES];
+static int nr_modes;
+module_param_array(modes, charp, &nr_modes, 0444);
+MODULE_PARM_DESC(modes, "Mode of each queue: fifo (default), percpu (relaxed order, scalable), prio, msg or bcast");
+
+static const char * const overflow_names[] = {
+	[OVERFLOW_BLOCK] = "block",
+	[OVERFLOW_DROP_NEWEST] = "drop-newest",
+	[OVERFLOW_DROP_OLDEST] = "drop-oldest",
+	[OVERFLOW_FAIL_FAST] = "fail-fast",
+};
+
+static char *overflow[MAX_QUEUES];
+static int nr_overflow;
+module_param_array(overflow, charp, &nr_overflow, 0444);
+MODULE_PARM_DESC(overflow, "Full queue policy of each queue: block (default), drop-newest, drop-oldest or fail-fast");
+
+static bool fair[MAX_QUEUES];
+static int nr_fair;
+module_param_array(fair, bool, &nr_fair, 0444);
+MODULE_PARM_DESC(fair, "Serve the blocked readers and writers of each queue in arrival order");
+
+/* Initial capacity of each queue, rounded up to a power of two */
+static unsigned int capacity = MAX_ITEMS_CBUF;
+module_param(capacity, uint, 0444);
+MODULE_PARM_DESC(capacity, "Initial capacity of each queue in items (rounded up to a power of two)");
+
+static unsigned int msg_bytes = MSG_BYTES;
+module_param(msg_bytes, uint, 0444);
+MODULE_PARM_DESC(msg_bytes, "Capacity of each msg queue in bytes (rounded up to a power of two)");
+
+/*
+ * Wakeup batching: sleeping consumers are only woken once wake_items
+ * items are queued, and sleeping producers once wake_slots slots are free.
+ * A task that slept for wake_timeout_ms without reaching a watermark
+ * above 1 retries with whatever is available (0 = wait for the watermark
+ * forever). Sleepers wait exclusively: a wakeup reaches a single task,
+ * which passes it on if there is still work left for another one.
+ */
+static unsigned int wake_items = 1;
+module_param(wake_items, uint, 0644);
+MODULE_PARM_DESC(wake_items, "Queued items needed to wake up consumers");
+
+static unsigned int wake_slots = 1;
+module_param(wake_slots, uint, 0644);
+MODULE_PARM_DESC(wake_slots, "Free slots needed to wake up producers");
+
+static unsigned int wake_timeout_ms = 10;	/* Only used by watermarks above 1 */
+module_param(wake_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(wake_timeout_ms, "Max time a task waits for its watermark (ms, 0 = no limit)");
+
+static unsigned int spin_ns = 10000;
+module_param(spin_ns, uint, 0444);
+MODULE_PARM_DESC(spin_ns, "Initial max time a task spins before sleeping (ns, 0 = never spin)");
+
+static unsigned int ring_slots = RING_SLOTS;
+module_param(ring_slots, uint, 0444);
+MODULE_PARM_DESC(ring_slots, "Slots of the mmap ring of each queue (rounded up to a power of two)");
+
+/*
+ * Lagging readers of bcast queues either block the producers (default) or
+ * lose the oldest items, which are counted as overruns of the reader.
+ */
+static bool bcast_drop;
+module_param(bcast_drop, bool, 0644);
+MODULE_PARM_DESC(bcast_drop, "Drop the oldest items of lagging bcast readers instead of blocking writers");
+
+/* Defaults of the per-file timeouts (PRODCONS_SET_TIMEOUTS) */
+static unsigned int read_timeout_ms;
+module_param(read_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(read_timeout_ms, "Max time a read may block (ms, 0 = no limit)");
+
+static unsigned int write_timeout_ms;
+module_param(write_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(write_timeout_ms, "Max time a write may block (ms, 0 = no limit)");
+
+/* Reader of a bcast queue, linked in q->readers while the file is open */
+struct prodcons_reader {
+	struct list_head list;
+	unsigned long cursor;	/* Sequence number of the next item to read */
+	u64 overruns;	/* Items dropped before this reader got them */
+};
+
+/* Per open file state (filp->private_data) */
+struct prodcons_file {
+	struct prodcons_queue *q;
+	int format;	/* PRODCONS_FMT_* */
+	unsigned int read_timeout_ms;	/* 0 = no limit */
+	unsigned int write_timeout_ms;
+	bool ring_mapped;	/* The ring was mmapped through this file */
+	bool bcast_reader;	/* rd is linked in the readers of q */
+	struct prodcons_reader rd;
+	/* Time reads/writes spent in fair queues (protected by q->lock) */
+	struct prodcons_wait_hist read_waits;
+	struct prodcons_wait_hist write_waits;
+};
+
+static struct prodcons_queue *queues[MAX_QUEUES];
 static dev_t start;
 static struct cdev* chardev = NULL;
+static struct class* class = NULL;
 
+/*
+ * splice()/sendfile() move data between the queue and pipes or files
+ * through the read_iter/write_iter methods, without user buffers. Before
+ * 4.9 generic_file_splice_read() goes through the page cache (always EOF
+ * here), and without .splice_read default_file_splice_read() uses
+ * ->read_iter instead.
+ */
 static struct file_operations fops = {
-    .read = device_read,
-    .write = device_write,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .open = device_open,
-    .release = device_release
+    .release = device_release,
+    .unlocked_ioctl = device_ioctl,
+    .poll = device_poll,
+    .mmap = device_mmap
+};
+
+
+/**
+ * Set up permissions for device files created by this driver
+ *
+ * The permission mode is returned using the mode parameter.
+ *
+ * The return value (unused here) could be used to indicate the directory
+ * name under /dev where to create the device file. If used, it should be
+ * a string whose memory must be allocated dynamically.
+ **/
+static char *cool_devnode(struct device *dev, umode_t *mode)
+{
+    if (!mode)
+        return NULL;
+    if (MAJOR(dev->devt) == MAJOR(start))
+        *mode = 0666;
+    return NULL;
+}
+
+/*
+ * kfifo_alloc() is not NUMA aware, so the buffer is allocated on the
+ * node of the queue and handed to kfifo_init(), which wants at least two
+ * elements (a percpu sub-queue may be asked for just one)
+ */
+static int fifo_alloc(struct item_kfifo *fifo, unsigned int n, int node)
+{
+	struct prodcons_item *buf;
+
+	if (n == 0 || n > MAX_CAPACITY)
+		return -EINVAL;
+	n = roundup_pow_of_two(max(n, 2U));
+	if ((buf = kmalloc_node(n * sizeof(*buf), GFP_KERNEL, node)) == NULL)
+		return -ENOMEM;
+
+	return kfifo_init(fifo, buf, n * sizeof(*buf));
+}
+
+/* Split n items among the sub-queues, each one local to its CPU */
+static int pcpu_alloc(struct prodcons_queue *q, unsigned int n)
+{
+	unsigned int per_cpu = DIV_ROUND_UP(n, num_possible_cpus());
+	struct prodcons_subq *sq;
+	int cpu, ret;
+
+	if ((q->pcpu = alloc_percpu(struct prodcons_subq)) == NULL)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		sq = per_cpu_ptr(q->pcpu, cpu);
+		spin_lock_init(&sq->lock);
+		if ((ret = fifo_alloc(&sq->fifo, per_cpu, cpu_to_node(cpu))))
+			return ret;
+		q->pcpu_size += kfifo_size(&sq->fifo);
+	}
+
+	return 0;
+}
+
+static void pcpu_free(struct prodcons_queue *q)
+{
+	int cpu;
+
+	if (!q->pcpu)
+		return;
+	for_each_possible_cpu(cpu)
+		kfifo_free(&per_cpu_ptr(q->pcpu, cpu)->fifo);
+	free_percpu(q->pcpu);
+}
+
+static int prio_alloc(struct prodcons_queue *q, unsigned int n)
+{
+	int i, ret;
+
+	for (i = 0; i < PRODCONS_NR_PRIOS; i++)
+		if ((ret = fifo_alloc(&q->prio[i], n, q->node)))
+			return ret;
+	q->prio_size = kfifo_size(&q->prio[0]);
+
+	return 0;
+}
+
+static int bcast_alloc(struct prodcons_queue *q, unsigned int n)
+{
+	n = roundup_pow_of_two(n);
+	if ((q->bcast = kmalloc_node(n * sizeof(*q->bcast), GFP_KERNEL, q->node)) == NULL)
+		return -ENOMEM;
+	q->bcast_mask = n - 1;
+
+	return 0;
+}
+
+static int msg_alloc(struct prodcons_queue *q, unsigned int bytes)
+{
+	char *buf;
+
+	bytes = roundup_pow_of_two(bytes);
+	if ((buf = kmalloc_node(bytes, GFP_KERNEL, q->node)) == NULL)
+		return -ENOMEM;
+
+	return kfifo_init(&q->msgs, buf, bytes);
+}
+
+static void queue_free(struct prodcons_queue *q)
+{
+	int i;
+
+	kfifo_free(&q->cbuf);
+	pcpu_free(q);
+	for (i = 0; i < PRODCONS_NR_PRIOS; i++)
+		kfifo_free(&q->prio[i]);
+	kfifo_free(&q->msgs);
+	kfree(q->bcast);
+	free_percpu(q->stats);
+	vfree(q->ring);
+	kfree(q);
+}
+
+/* Returns the new queue or an ERR_PTR() */
+static struct prodcons_queue *queue_alloc(int node, int mode)
+{
+	struct prodcons_queue *q;
+	int ret = -ENOMEM;
+
+	if ((q = kzalloc_node(sizeof(*q), GFP_KERNEL, node)) == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	q->node = node;
+	q->mode = mode;
+	spin_lock_init(&q->lock);
+	init_waitqueue_head(&q->consumers);
+	init_waitqueue_head(&q->producers);
+	INIT_LIST_HEAD(&q->readers);
+	INIT_LIST_HEAD(&q->fair_readers);
+	INIT_LIST_HEAD(&q->fair_writers);
+	spin_lock_init(&q->ring_lock);
+	init_waitqueue_head(&q->ring_consumers);
+	init_waitqueue_head(&q->ring_producers);
+
+	if ((q->stats = alloc_percpu(struct prodcons_stats)) == NULL)
+		goto error;
+	q->spin_ns = q->spin_max_ns = spin_ns;
+
+	if (mode == PRODCONS_MODE_PERCPU) {
+		if ((ret = pcpu_alloc(q, capacity)))
+			goto error;
+	} else if (mode == PRODCONS_MODE_PRIO) {
+		if ((ret = prio_alloc(q, capacity)))
+			goto error;
+	} else if (mode == PRODCONS_MODE_MSG) {
+		if ((ret = msg_alloc(q, msg_bytes)))
+			goto error;
+		q->msg_max = min_t(unsigned int, kfifo_size(&q->msgs) - 2, MAX_MSG_LEN) - sizeof(u64);
+	} else if (mode == PRODCONS_MODE_BCAST) {
+		if ((ret = bcast_alloc(q, capacity)))
+			goto error;
+	} else if ((ret = fifo_alloc(&q->cbuf, capacity, node)))
+		goto error;
+
+	q->ring_mask = ring_slots - 1;
+	q->ring = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(ring_slots * sizeof(s32)));
+	if (!q->ring) {
+		ret = -ENOMEM;
+		goto error;
+	}
+	q->ring->mask = q->ring_mask;
+	q->ring->data_offset = PAGE_SIZE;
+
+	return q;
+error:
+	queue_free(q);
+	return ERR_PTR(ret);
+}
+
+/*
+ * /sys/class/prodcons/prodconsN/dwell_ns: one "<min ns> <items>" line per
+ * non-empty bucket of the dwell time histogram of the queue
+ */
+static ssize_t dwell_ns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct prodcons_queue *q = dev_get_drvdata(dev);
+	unsigned long count;
+	ssize_t len = 0;
+	int b, cpu;
+
+	for (b = 0; b < DWELL_BUCKETS; b++) {
+		count = 0;
+		for_each_possible_cpu(cpu)
+			count += per_cpu_ptr(q->stats, cpu)->dwell[b];
+		if (count)
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%llu %lu\n",
+					 b ? 1ULL << (b - 1) : 0, count);
+	}
+
+	return len;
+}
+static DEVICE_ATTR_RO(dwell_ns);
+
+/* /sys/class/prodcons/prodconsN/spin_max_ns: spin budget limit of the queue */
+static ssize_t spin_max_ns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct prodcons_queue *q = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(q->spin_max_ns));
+}
+
+static ssize_t spin_max_ns_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct prodcons_queue *q = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	if ((ret = kstrtouint(buf, 0, &val)))
+		return ret;
+	WRITE_ONCE(q->spin_max_ns, val);
+	WRITE_ONCE(q->spin_ns, val);
+	return count;
+}
+static DEVICE_ATTR_RW(spin_max_ns);
+
+static struct attribute *prodcons_attrs[] = {
+	&dev_attr_dwell_ns.attr,
+	&dev_attr_spin_max_ns.attr,
+	NULL,
 };
 
+static const struct attribute_group prodcons_group = {
+	.attrs = prodcons_attrs,
+};
+
+/* Sum of a per-CPU counter of q */
+#define stat_sum(q, field)						\
+({									\
+	unsigned long long __sum = 0;					\
+	int __cpu;							\
+									\
+	for_each_possible_cpu(__cpu)					\
+		__sum += per_cpu_ptr((q)->stats, __cpu)->field;		\
+	__sum;								\
+})
+
+/* /sys/class/prodcons/prodconsN/stats/<field>, read only */
+#define STAT_ATTR(field)						\
+static ssize_t field##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+{									\
+	struct prodcons_queue *q = dev_get_drvdata(dev);		\
+									\
+	return sprintf(buf, "%llu\n", stat_sum(q, field));		\
+}									\
+static DEVICE_ATTR_RO(field)
+
+STAT_ATTR(enqueued);
+STAT_ATTR(dequeued);
+STAT_ATTR(producer_blocks);
+STAT_ATTR(consumer_blocks);
+STAT_ATTR(blocked_ns);
+STAT_ATTR(eintr);
+STAT_ATTR(parse_rejects);
+
+static inline unsigned int cbuf_items(struct prodcons_queue *q);
+
+static ssize_t depth_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", cbuf_items(dev_get_drvdata(dev)));
+}
+static DEVICE_ATTR_RO(depth);
+
+static ssize_t max_depth_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct prodcons_queue *q = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(q->high_water));
+}
+static DEVICE_ATTR_RO(max_depth);
+
+static ssize_t dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct prodcons_queue *q = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%ld\n", atomic_long_read(&q->dropped));
+}
+static DEVICE_ATTR_RO(dropped);
+
+static struct attribute *stats_attrs[] = {
+	&dev_attr_enqueued.attr,
+	&dev_attr_dequeued.attr,
+	&dev_attr_depth.attr,
+	&dev_attr_max_depth.attr,
+	&dev_attr_dropped.attr,
+	&dev_attr_producer_blocks.attr,
+	&dev_attr_consumer_blocks.attr,
+	&dev_attr_blocked_ns.attr,
+	&dev_attr_eintr.attr,
+	&dev_attr_parse_rejects.attr,
+	NULL,
+};
+
+static const struct attribute_group stats_group = {
+	.name = "stats",
+	.attrs = stats_attrs,
+};
+
+static const struct attribute_group *prodcons_groups[] = {
+	&prodcons_group,
+	&stats_group,
+	NULL,
+};
+
+/* Index of name in names[n], or -EINVAL */
+static int match_name(const char *name, const char * const *names, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (sysfs_streq(name, names[i]))
+			return i;
+	return -EINVAL;
+}
 
 /*
  * This function is called when the module is loaded
@@ -49,14 +654,53 @@ int init_module(void)
     int major;      /* Major number assigned to our device driver */
     int minor;      /* Minor number assigned to the associated character device */
     int ret;
+    int i;
+    struct device *device;
 
-	if (kfifo_alloc(&cbuf,MAX_ITEMS_CBUF*sizeof(int),GFP_KERNEL))
-		return -ENOMEM;
+	if (nr_queues == 0 || nr_queues > MAX_QUEUES)
+		return -EINVAL;
+	if (capacity == 0 || capacity > MAX_CAPACITY)
+		return -EINVAL;
+	if (msg_bytes < 16 || msg_bytes > MAX_CAPACITY * sizeof(struct prodcons_item))
+		return -EINVAL;
+	if (ring_slots == 0 || ring_slots > MAX_RING_SLOTS)
+		return -EINVAL;
+	ring_slots = roundup_pow_of_two(ring_slots);
+
+	for (i = 0; i < nr_queues; i++) {
+		int node = i < nr_numa_nodes ? numa_nodes[i] : NUMA_NO_NODE;
+		int mode = PRODCONS_MODE_FIFO;
+		int policy = OVERFLOW_BLOCK;
+
+		if (node != NUMA_NO_NODE &&
+		    (node < 0 || node >= nr_node_ids || !node_online(node)))
+			node = NUMA_NO_NODE;
+		if (i < nr_modes &&
+		    (mode = match_name(modes[i], mode_names, ARRAY_SIZE(mode_names))) < 0) {
+			pr_err("Unknown queue mode %s\n", modes[i]);
+			ret = -EINVAL;
+			goto error_queues;
+		}
+		if (i < nr_overflow &&
+		    (policy = match_name(overflow[i], overflow_names, ARRAY_SIZE(overflow_names))) < 0) {
+			pr_err("Unknown overflow policy %s\n", overflow[i]);
+			ret = -EINVAL;
+			goto error_queues;
+		}
+		queues[i] = queue_alloc(node, mode);
+		if (IS_ERR(queues[i])) {
+			ret = PTR_ERR(queues[i]);
+			queues[i] = NULL;
+			goto error_queues;
+		}
+		queues[i]->overflow = policy;
+		queues[i]->fair = fair[i];
+	}
 
 	/* Get available (major,minor) range */
-    	if ((ret = alloc_chrdev_region (&start, 0, 1, DEVICE_NAME))) {
+    	if ((ret = alloc_chrdev_region (&start, 0, nr_queues, DEVICE_NAME))) {
         	printk(KERN_INFO "Can't allocate chrdev_region()");
-        	return ret;
+        	goto error_queues;
     	}
 
     	/* Create associated cdev */
@@ -68,32 +712,61 @@ int init_module(void)
 
     	cdev_init(chardev, &fops);
 
-    	if ((ret = cdev_add(chardev, start, 1))) {
+    	if ((ret = cdev_add(chardev, start, nr_queues))) {
         	printk(KERN_INFO "cdev_add() failed ");
         	goto error_add;
     	}
 
+	/* Create custom class */
+	class = class_create(THIS_MODULE, CLASS_NAME);
+
+	if (IS_ERR(class)) {
+		pr_err("class_create() failed \n");
+		ret = PTR_ERR(class);
+		goto error_class;
+	}
+
+	/* Establish function that will take care of setting up permissions for device file */
+	class->devnode = cool_devnode;
+
     	major = MAJOR(start);
     	minor = MINOR(start);
 
+	/* One device file per queue: /dev/prodcons0 ... */
+	for (i = 0; i < nr_queues; i++) {
+		device = device_create_with_groups(class, NULL, MKDEV(major, minor + i), queues[i],
+						   prodcons_groups, DEVICE_NAME "%d", i);
+		if (IS_ERR(device)) {
+			pr_err("Device_create failed\n");
+			ret = PTR_ERR(device);
+			goto error_device;
+		}
+		queues[i]->device = device;
+	}
+
     	printk(KERN_INFO "I was assigned major number %d. To talk to\n", major);
-    	printk(KERN_INFO "the driver try to cat and echo to /dev/%s.\n", DEVICE_NAME);
+    	printk(KERN_INFO "the driver try to cat and echo to /dev/%s0.\n", DEVICE_NAME);
     	printk(KERN_INFO "Remove the module when done.\n");
 
-	sema_init(&elementos,0);
-	sema_init(&huecos,MAX_ITEMS_CBUF);
-	sema_init(&mtx, 1);
-
     	return 0;
 
+	error_device:
+		while (--i >= 0)
+			device_destroy(class, MKDEV(major, minor + i));
+		class_destroy(class);
+	error_class:
+		/* Destroy chardev */
+		cdev_del(chardev);
+		chardev = NULL;
 	error_add:
     	/* Destroy partially initialized chardev */
     	if (chardev)
         	kobject_put(&chardev->kobj);
 	error_alloc:
-    		unregister_chrdev_region(start, 1);
-
-	kfifo_free(&cbuf);
+    		unregister_chrdev_region(start, nr_queues);
+	error_queues:
+		for (i = 0; i < nr_queues && queues[i]; i++)
+			queue_free(queues[i]);
 
     	return ret;
 }
@@ -103,7 +776,13 @@ int init_module(void)
  */
 void cleanup_module(void)
 {
-    kfifo_free(&cbuf);
+    int i;
+
+    for (i = 0; i < nr_queues; i++)
+        device_destroy(class, MKDEV(MAJOR(start), MINOR(start) + i));
+
+    if (class)
+        class_destroy(class);
 
     /* Destroy chardev */
     if (chardev)
@@ -112,7 +791,46 @@ void cleanup_module(void)
     /*
      * Release major minor pair
      */
-    unregister_chrdev_region(start, 1);
+    unregister_chrdev_region(start, nr_queues);
+
+    for (i = 0; i < nr_queues; i++)
+        queue_free(queues[i]);
+}
+
+/* Recompute bcast_tail (q->lock held) */
+static void bcast_update_tail(struct prodcons_queue *q)
+{
+	struct prodcons_reader *rd;
+	unsigned long tail = q->bcast_head;
+
+	list_for_each_entry(rd, &q->readers, list)
+		if (q->bcast_head - rd->cursor > q->bcast_head - tail)
+			tail = rd->cursor;
+	q->bcast_tail = tail;
+}
+
+/* Make pf a reader of its bcast queue, once, from the next item written */
+static void bcast_join(struct prodcons_queue *q, struct prodcons_file *pf)
+{
+	spin_lock(&q->lock);
+	if (!pf->bcast_reader) {
+		pf->rd.cursor = q->bcast_head;
+		pf->rd.overruns = 0;
+		list_add_tail(&pf->rd.list, &q->readers);
+		pf->bcast_reader = true;
+	}
+	spin_unlock(&q->lock);
+}
+
+static void bcast_leave(struct prodcons_queue *q, struct prodcons_reader *rd)
+{
+	spin_lock(&q->lock);
+	list_del(&rd->list);
+	bcast_update_tail(q);
+	spin_unlock(&q->lock);
+
+	/* This may have been the slowest reader */
+	wake_up_interruptible(&q->producers);
 }
 
 /*
@@ -121,15 +839,35 @@ void cleanup_module(void)
  */
 static int device_open(struct inode *inode, struct file *file)
 {
-    //if (Device_Open)
-        //return -EBUSY;
+    struct prodcons_file *pf;
+
+    if ((pf = kzalloc(sizeof(*pf), GFP_KERNEL)) == NULL)
+        return -ENOMEM;
+    pf->q = queues[iminor(inode) - MINOR(start)];
+    pf->format = PRODCONS_FMT_TEXT;
+    pf->read_timeout_ms = read_timeout_ms;
+    pf->write_timeout_ms = write_timeout_ms;
+    file->private_data = pf;
 
-    //Device_Open++;
+    /*
+     * Readers of a bcast queue get the items written from now on. Those
+     * opened for writing as well join on their first read, so that one
+     * that only writes does not throttle (itself included) the writers.
+     */
+    if (pf->q->mode == PRODCONS_MODE_BCAST &&
+        (file->f_mode & (FMODE_READ | FMODE_WRITE)) == FMODE_READ)
+        bcast_join(pf->q, pf);
 
     /* Increment the module's reference counter */
     try_module_get(THIS_MODULE);
 
-    return SUCCESS;
+#ifdef FMODE_NOWAIT
+    /* Reads and writes honour IOCB_NOWAIT */
+    file->f_mode |= FMODE_NOWAIT;
+#endif
+
+    /* The device is a stream: every read/write works on the queue head/tail */
+    return nonseekable_open(inode, file);
 }
 
 /*
@@ -137,7 +875,11 @@ static int device_open(struct inode *inode, struct file *file)
  */
 static int device_release(struct inode *inode, struct file *file)
 {
-    //Device_Open--;      /* We're now ready for our next caller */
+    struct prodcons_file *pf = file->private_data;
+
+    if (pf->bcast_reader)
+        bcast_leave(pf->q, &pf->rd);
+    kfree(pf);
 
     /*
      * Decrement the usage count, or else once you opened the file, you'll
@@ -149,77 +891,1600 @@ static int device_release(struct inode *inode, struct file *file)
 }
 
 /*
- * Called when a process, which already opened the dev file, attempts to
- * read from it.
- */
-static ssize_t device_read(struct file *filp,   /* see include/linux/fs.h   */
-                           char *buff,    /* buffer to fill with data */
-                           size_t len,   /* length of the buffer     */
-                           loff_t * off)
-{
-	char *kbuf = kmalloc(MAX_ITEMS_CBUF+1, GFP_KERNEL);
-    	int nr_bytes=0;
-    	int val, ret;
-    	if ((*off)>0){
-		kfree(kbuf);
-        	return 0;
-	}
-    	if (down_interruptible(&elementos)){
-		kfree(kbuf);
-		return -EINTR;
-	}
-	if (down_interruptible(&mtx)){
-		up(&elementos);
-		return -EINTR;
-	}
-	/* Extraer el primer entero del buffer */
-	ret = kfifo_out(&cbuf,&val,sizeof(int));
-	if(ret < 0){
-		kfree(kbuf);
-		return -EINVAL;
-	}
-	up(&mtx);
-	up(&huecos);
-	nr_bytes=sprintf(kbuf,"%i\n",val);
-	if(copy_to_user(buff, kbuf, nr_bytes)){
-		kfree(kbuf);
-		return -EINVAL;
-	}
+ * Number of items / free slots in the queue (lockless snapshot). In bcast
+ * queues, items not yet read by the slowest reader.
+ */
+static inline unsigned int cbuf_items(struct prodcons_queue *q)
+{
+	if (q->mode == PRODCONS_MODE_PERCPU)
+		return min_t(unsigned int, atomic_read(&q->pcpu_items), q->pcpu_size);
+	if (q->mode == PRODCONS_MODE_PRIO)
+		return READ_ONCE(q->prio_items);
+	if (q->mode == PRODCONS_MODE_MSG)
+		return READ_ONCE(q->msg_count);
+	if (q->mode == PRODCONS_MODE_BCAST)
+		return READ_ONCE(q->bcast_head) - READ_ONCE(q->bcast_tail);
+	return kfifo_len(&q->cbuf);
+}
+
+static inline unsigned int cbuf_size(struct prodcons_queue *q)
+{
+	if (q->mode == PRODCONS_MODE_PERCPU)
+		return q->pcpu_size;
+	if (q->mode == PRODCONS_MODE_PRIO)
+		return q->prio_size;
+	if (q->mode == PRODCONS_MODE_MSG)
+		return kfifo_size(&q->msgs);
+	if (q->mode == PRODCONS_MODE_BCAST)
+		return q->bcast_mask + 1;
+	return kfifo_size(&q->cbuf);
+}
+
+/* Free bytes (not slots) in msg queues */
+static inline unsigned int cbuf_slots(struct prodcons_queue *q)
+{
+	if (q->mode == PRODCONS_MODE_MSG)
+		return kfifo_size(&q->msgs) - kfifo_len(&q->msgs);
+	return cbuf_size(q) - cbuf_items(q);
+}
+
+/* Watermarks can never exceed the buffer, or nobody would be woken up */
+static inline unsigned int watermark(struct prodcons_queue *q, unsigned int mark)
+{
+	unsigned int size = cbuf_size(q);
+
+	if (mark == 0)
+		return 1;
+	return mark > size ? size : mark;
+}
 
-	(*off) += len;
+/* With a watermark of 1 any item (slot) wakes the task: no need to retry */
+static inline long wake_timeout(unsigned int mark)
+{
+	if (mark <= 1 || wake_timeout_ms == 0)
+		return MAX_SCHEDULE_TIMEOUT;
+	return msecs_to_jiffies(wake_timeout_ms);
+}
+
+/* Wake up a consumer (producer) if there is enough work for it */
+static inline void wake_consumer(struct prodcons_queue *q)
+{
+	if (cbuf_items(q) >= watermark(q, wake_items))
+		wake_up_interruptible(&q->consumers);
+}
 
-    	return nr_bytes;
+static inline void wake_producer(struct prodcons_queue *q)
+{
+	if (cbuf_slots(q) >= watermark(q, wake_slots))
+		wake_up_interruptible(&q->producers);
 }
 
 /*
- * Called when a process writes to dev file: echo "hi" > /dev/chardev
+ * wait_event_interruptible_timeout() as an exclusive waiter, so that a
+ * wake_up() of wq wakes one task instead of the whole herd. A task that
+ * leaves because of a signal or the timeout after cond became true may
+ * have taken the wakeup of another one, so it hands it on.
+ */
+#define wait_exclusive_timeout(wq, cond, timeout)			\
+({									\
+	DEFINE_WAIT(__wait);						\
+	long __ret = (timeout);						\
+									\
+	for (;;) {							\
+		prepare_to_wait_exclusive(&(wq), &__wait, TASK_INTERRUPTIBLE); \
+		if (cond)						\
+			break;						\
+		if (signal_pending(current)) {				\
+			__ret = -ERESTARTSYS;				\
+			break;						\
+		}							\
+		if ((__ret = schedule_timeout(__ret)) == 0)		\
+			break;						\
+	}								\
+	finish_wait(&(wq), &__wait);					\
+	if (__ret <= 0 && (cond))					\
+		wake_up_interruptible(&(wq));				\
+	__ret;								\
+})
+
+/*
+ * Sub-queue visited in i-th place by the current CPU: its own one first,
+ * then the others round robin. Returns NULL past the last one.
  */
-static ssize_t
-device_write(struct file *filp, const char *buff, size_t len, loff_t * off)
+static struct prodcons_subq *pcpu_subq(struct prodcons_queue *q, int first, int i)
 {
-	char *kbuf = kmalloc(MAX_ITEMS_CBUF+1, GFP_KERNEL);
-	int val=0;
-	if(copy_from_user(kbuf, buff, len)){
-		kfree(kbuf);
-		return -EINVAL;
+	int cpu;
+
+	for (; i < nr_cpu_ids; i++) {
+		cpu = (first + i) % nr_cpu_ids;
+		if (cpu_possible(cpu))
+			return per_cpu_ptr(q->pcpu, cpu);
 	}
-	if(sscanf(kbuf, "%i", &val) != 1){
-		kfree(kbuf);
-		return -EINVAL;
+	return NULL;
+}
+
+#define for_each_subq(q, sq, first, i) \
+	for (i = 0, first = raw_smp_processor_id(); \
+	     (sq = pcpu_subq(q, first, i)) != NULL; i++)
+
+/* Account an item dequeued at now, and the time it waited in the queue */
+static inline void dwell_add(struct prodcons_queue *q, const struct prodcons_item *it, u64 now)
+{
+	int b = fls64(now - it->ts);
+
+	this_cpu_inc(q->stats->dequeued);
+	this_cpu_inc(q->stats->dwell[min(b, DWELL_BUCKETS - 1)]);
+}
+
+/* Account a sleep of a producer (consumer) that began at start */
+static void stat_blocked(struct prodcons_queue *q, bool producer, u64 start, bool intr)
+{
+	if (producer)
+		this_cpu_inc(q->stats->producer_blocks);
+	else
+		this_cpu_inc(q->stats->consumer_blocks);
+	this_cpu_add(q->stats->blocked_ns, ktime_get_ns() - start);
+	if (intr)
+		this_cpu_inc(q->stats->eintr);
+}
+
+/*
+ * Append it to kbuf[*pos..size) in the given format: a "%i\n" line, a raw
+ * int or a struct prodcons_ts_rec. Returns false if it does not fit.
+ */
+static bool put_item(const struct prodcons_item *it, int format,
+		     char *kbuf, size_t size, size_t *pos)
+{
+	char line[MAX_ITEM_LEN + 1];
+	struct prodcons_ts_rec rec;
+	const void *src;
+	size_t n;
+
+	if (format == PRODCONS_FMT_BINARY) {
+		src = &it->val;
+		n = sizeof(int);
+	} else if (format == PRODCONS_FMT_BINARY_TS) {
+		rec.value = it->val;
+		rec.pad = 0;
+		rec.ts_ns = it->ts;
+		src = &rec;
+		n = sizeof(rec);
+	} else {
+		n = sprintf(line, "%i\n", it->val);
+		src = line;
 	}
-		
-	if (down_interruptible(&huecos)){
-		kfree(kbuf);
-		return -EINTR;
+
+	if (*pos + n > size)
+		return false;
+	memcpy(kbuf + *pos, src, n);
+	*pos += n;
+	return true;
+}
+
+/*
+ * Format as many items of fifo as fit in kbuf[*pos..size) (one "%i\n"
+ * line each) and remove them. Returns the number of items removed and sets
+ * *full if it stopped because the next item did not fit.
+ */
+static unsigned int __fifo_format(struct prodcons_queue *q, struct item_kfifo *fifo,
+				  char *kbuf, size_t size, size_t *pos, bool *full)
+{
+	struct prodcons_item it;
+	unsigned int done = 0;
+	u64 now = ktime_get_ns();
+
+	while (kfifo_peek(fifo, &it)) {
+		if (!put_item(&it, PRODCONS_FMT_TEXT, kbuf, size, pos)) {
+			*full = true;
+			break;
+		}
+		dwell_add(q, &it, now);
+		kfifo_skip(fifo);
+		done++;
 	}
-	if (down_interruptible(&mtx)) {
-		up(&huecos);
-		return -EINTR;
+
+	return done;
+}
+
+static unsigned int fifo_format(struct prodcons_queue *q, struct item_kfifo *fifo,
+				spinlock_t *lock, char *kbuf, size_t size, size_t *pos, bool *full)
+{
+	unsigned int done;
+
+	spin_lock(lock);
+	done = __fifo_format(q, fifo, kbuf, size, pos, full);
+	spin_unlock(lock);
+
+	return done;
+}
+
+/* Same as fifo_format() for the levels of a prio queue, most urgent first */
+static void prio_format(struct prodcons_queue *q, char *kbuf, size_t size, size_t *pos, bool *full)
+{
+	int prio;
+
+	spin_lock(&q->lock);
+	while (q->prio_map && !*full) {
+		prio = __ffs(q->prio_map);
+		q->prio_items -= __fifo_format(q, &q->prio[prio], kbuf, size, pos, full);
+		if (kfifo_is_empty(&q->prio[prio]))
+			__clear_bit(prio, &q->prio_map);
 	}
+	spin_unlock(&q->lock);
+}
 
-	kfifo_in(&cbuf,&val,sizeof(int));
-	up(&mtx);
-	up(&elementos);
+/*
+ * Format as many queued items as fit in kbuf and remove them from the
+ * queue. Returns the number of bytes written to kbuf, 0 if the queue is
+ * empty or -ENOSPC if not even the first item fits.
+ */
+static int cbuf_format(struct prodcons_queue *q, char *kbuf, size_t size)
+{
+	struct prodcons_subq *sq;
+	size_t pos = 0;
+	bool full = false;
+	int first, i;
 
-	return len;
+	if (q->mode == PRODCONS_MODE_PERCPU) {
+		for_each_subq(q, sq, first, i) {
+			atomic_sub(fifo_format(q, &sq->fifo, &sq->lock, kbuf, size, &pos, &full),
+				   &q->pcpu_items);
+			if (full)
+				break;
+		}
+	} else if (q->mode == PRODCONS_MODE_PRIO)
+		prio_format(q, kbuf, size, &pos, &full);
+	else
+		fifo_format(q, &q->cbuf, &q->lock, kbuf, size, &pos, &full);
+
+	if (pos == 0 && full)
+		return -ENOSPC;
+	return pos;
+}
+
+/* Stamp and enqueue up to n items in fifo. Returns how many fit. */
+static unsigned int fifo_in(struct item_kfifo *fifo, const int *vals, unsigned int n, u64 now)
+{
+	struct prodcons_item it = { .ts = now };
+	unsigned int done;
+
+	for (done = 0; done < n; done++) {
+		it.val = vals[done];
+		if (!kfifo_put(fifo, it))
+			break;
+	}
+
+	return done;
+}
+
+/*
+ * Same as fifo_in(), but first discard the oldest items needed to make
+ * room for the new ones (drop-oldest policy). The caller holds the lock
+ * of fifo, so items are only dropped while the fifo is really full.
+ */
+static unsigned int fifo_in_overwrite(struct item_kfifo *fifo, const int *vals, unsigned int n,
+				      u64 now, unsigned int *dropped)
+{
+	unsigned int avail = kfifo_avail(fifo), i;
+
+	*dropped = 0;
+	if (n > avail) {
+		*dropped = min(n - avail, kfifo_len(fifo));
+		for (i = 0; i < *dropped; i++)
+			kfifo_skip(fifo);
+	}
+
+	return fifo_in(fifo, vals, n, now);
+}
+
+/* Enqueue up to n items in a prio queue (q->lock held) */
+static unsigned int prio_enqueue(struct prodcons_queue *q, const int *vals,
+				 const u8 *prios, unsigned int n, u64 now)
+{
+	struct prodcons_item it = { .ts = now };
+	unsigned int done;
+	int prio;
+
+	for (done = 0; done < n && q->prio_items < q->prio_size; done++) {
+		prio = prios ? prios[done] : DEFAULT_PRIO;
+		it.val = vals[done];
+		kfifo_put(&q->prio[prio], it);
+		__set_bit(prio, &q->prio_map);
+		q->prio_items++;
+	}
+	if (q->prio_items > q->high_water)
+		q->high_water = q->prio_items;
+
+	return done;
+}
+
+/* Discard up to n of the oldest items of the least urgent level (q->lock held) */
+static unsigned int prio_drop(struct prodcons_queue *q, unsigned int n)
+{
+	unsigned int done = 0;
+	int prio;
+
+	while (done < n && q->prio_map) {
+		prio = __fls(q->prio_map);
+		for (; done < n && !kfifo_is_empty(&q->prio[prio]); done++)
+			kfifo_skip(&q->prio[prio]);
+		if (kfifo_is_empty(&q->prio[prio]))
+			__clear_bit(prio, &q->prio_map);
+	}
+	q->prio_items -= done;
+
+	return done;
+}
+
+static unsigned int prio_in(struct prodcons_queue *q, const int *vals,
+			    const u8 *prios, unsigned int n)
+{
+	unsigned int done;
+
+	spin_lock(&q->lock);
+	done = prio_enqueue(q, vals, prios, n, ktime_get_ns());
+	spin_unlock(&q->lock);
+
+	return done;
+}
+
+static unsigned int prio_out(struct prodcons_queue *q, struct prodcons_item *items, unsigned int n)
+{
+	unsigned int done = 0;
+	int prio;
+
+	spin_lock(&q->lock);
+	while (done < n && q->prio_map) {
+		prio = __ffs(q->prio_map);
+		done += kfifo_out(&q->prio[prio], items + done, n - done);
+		if (kfifo_is_empty(&q->prio[prio]))
+			__clear_bit(prio, &q->prio_map);
+	}
+	q->prio_items -= done;
+	spin_unlock(&q->lock);
+
+	return done;
+}
+
+/*
+ * Writers of a bcast queue either wait for the slowest reader or, with
+ * bcast_drop or the drop-oldest policy, push the cursors of the readers
+ * that would be overrun.
+ */
+static unsigned int bcast_in(struct prodcons_queue *q, const int *vals, unsigned int n)
+{
+	unsigned int size = q->bcast_mask + 1, done, lag, i;
+	struct prodcons_reader *rd;
+	u64 now = ktime_get_ns();
+
+	spin_lock(&q->lock);
+	if (READ_ONCE(bcast_drop) || q->overflow == OVERFLOW_DROP_OLDEST) {
+		done = min(n, size);
+		list_for_each_entry(rd, &q->readers, list) {
+			lag = q->bcast_head + done - rd->cursor;
+			if (lag > size) {
+				rd->overruns += lag - size;
+				rd->cursor += lag - size;
+			}
+		}
+	} else
+		done = min(n, size - (unsigned int)(q->bcast_head - q->bcast_tail));
+
+	for (i = 0; i < done; i++) {
+		q->bcast[(q->bcast_head + i) & q->bcast_mask].val = vals[i];
+		q->bcast[(q->bcast_head + i) & q->bcast_mask].ts = now;
+	}
+	WRITE_ONCE(q->bcast_head, q->bcast_head + done);
+	bcast_update_tail(q);
+	if (q->bcast_head - q->bcast_tail > q->high_water)
+		q->high_water = q->bcast_head - q->bcast_tail;
+	spin_unlock(&q->lock);
+
+	return done;
+}
+
+/* Items the reader has not got yet (lockless snapshot) */
+static inline unsigned int bcast_pending(struct prodcons_queue *q, struct prodcons_reader *rd)
+{
+	return READ_ONCE(q->bcast_head) - READ_ONCE(rd->cursor);
+}
+
+/*
+ * Copy the items of rd to kbuf in the given format, as many as fit in
+ * size bytes, and move its cursor past them. Returns the number of bytes,
+ * 0 if there are no items for rd or -ENOSPC if not even the first one fits.
+ * The dwell time of bcast items is accounted once per reader.
+ */
+static int bcast_out(struct prodcons_queue *q, struct prodcons_reader *rd,
+		     char *kbuf, size_t size, int format)
+{
+	struct prodcons_item *it;
+	unsigned long cursor;
+	size_t pos = 0;
+	u64 now = ktime_get_ns();
+
+	spin_lock(&q->lock);
+	for (cursor = rd->cursor; cursor != q->bcast_head; cursor++) {
+		it = &q->bcast[cursor & q->bcast_mask];
+		if (!put_item(it, format, kbuf, size, &pos))
+			break;
+		dwell_add(q, it, now);
+	}
+	if (pos == 0 && cursor != q->bcast_head) {
+		spin_unlock(&q->lock);
+		return -ENOSPC;
+	}
+	WRITE_ONCE(rd->cursor, cursor);
+	bcast_update_tail(q);
+	spin_unlock(&q->lock);
+
+	return pos;
+}
+
+/*
+ * Non-blocking enqueue/dequeue of up to n items. Returns how many items
+ * were moved. prios (may be NULL) is only used by prio queues.
+ */
+static unsigned int queue_in(struct prodcons_queue *q, const int *vals,
+			     const u8 *prios, unsigned int n)
+{
+	struct prodcons_subq *sq;
+	unsigned int done = 0, items;
+	int first, i;
+	u64 now;
+
+	if (q->mode == PRODCONS_MODE_PRIO)
+		return prio_in(q, vals, prios, n);
+	if (q->mode == PRODCONS_MODE_BCAST)
+		return bcast_in(q, vals, n);
+
+	now = ktime_get_ns();
+	if (q->mode != PRODCONS_MODE_PERCPU) {
+		spin_lock(&q->lock);
+		done = fifo_in(&q->cbuf, vals, n, now);
+		if (kfifo_len(&q->cbuf) > q->high_water)
+			q->high_water = kfifo_len(&q->cbuf);
+		spin_unlock(&q->lock);
+		return done;
+	}
+
+	/* Reserve first: pcpu_items must never be lower than the real count */
+	items = atomic_add_return(n, &q->pcpu_items);
+	for_each_subq(q, sq, first, i) {
+		spin_lock(&sq->lock);
+		done += fifo_in(&sq->fifo, vals + done, n - done, now);
+		spin_unlock(&sq->lock);
+		if (done == n)
+			break;
+	}
+	atomic_sub(n - done, &q->pcpu_items);
+
+	items = min(items - (n - done), q->pcpu_size);
+	if (items > READ_ONCE(q->high_water))
+		WRITE_ONCE(q->high_water, items);
+
+	return done;
+}
+
+static unsigned int queue_out(struct prodcons_queue *q, struct prodcons_item *items, unsigned int n)
+{
+	struct prodcons_subq *sq;
+	unsigned int done = 0;
+	int first, i;
+
+	if (q->mode == PRODCONS_MODE_PRIO)
+		return prio_out(q, items, n);
+	if (q->mode != PRODCONS_MODE_PERCPU)
+		return kfifo_out_spinlocked(&q->cbuf, items, n, &q->lock);
+
+	for_each_subq(q, sq, first, i) {
+		done += kfifo_out_spinlocked(&sq->fifo, items + done, n - done, &sq->lock);
+		if (done == n)
+			break;
+	}
+	atomic_sub(done, &q->pcpu_items);
+
+	return done;
+}
+
+/*
+ * Enqueue up to n items discarding, in the same critical section, just the
+ * oldest ones needed to make room (drop-oldest policy): those of the least
+ * urgent level in prio queues. Returns how many items were enqueued.
+ */
+static unsigned int queue_in_overwrite(struct prodcons_queue *q, const int *vals,
+				       const u8 *prios, unsigned int n, unsigned int *dropped)
+{
+	unsigned int done, free;
+	u64 now = ktime_get_ns();
+
+	spin_lock(&q->lock);
+	if (q->mode == PRODCONS_MODE_PRIO) {
+		free = q->prio_size - q->prio_items;
+		*dropped = n > free ? prio_drop(q, n - free) : 0;
+		done = prio_enqueue(q, vals, prios, n, now);
+	} else {
+		done = fifo_in_overwrite(&q->cbuf, vals, n, now, dropped);
+		if (kfifo_len(&q->cbuf) > q->high_water)
+			q->high_water = kfifo_len(&q->cbuf);
+	}
+	spin_unlock(&q->lock);
+
+	return done;
+}
+
+/*
+ * Discard up to n of the oldest items of a percpu queue (drop-oldest
+ * policy). Fifo and prio queues use queue_in_overwrite(), bcast queues
+ * drop in bcast_in(). Returns how many items were discarded.
+ */
+static unsigned int queue_drop(struct prodcons_queue *q, unsigned int n)
+{
+	struct prodcons_subq *sq;
+	unsigned int done = 0;
+	int first, i;
+
+	for_each_subq(q, sq, first, i) {
+		spin_lock(&sq->lock);
+		for (; done < n && !kfifo_is_empty(&sq->fifo); done++)
+			kfifo_skip(&sq->fifo);
+		spin_unlock(&sq->lock);
+		if (done == n)
+			break;
+	}
+	atomic_sub(done, &q->pcpu_items);
+
+	return done;
+}
+
+/* Parse a "value" or "prio:value" token */
+static int parse_item(char *tok, int *val, u8 *prio)
+{
+	char *sep = strchr(tok, ':');
+	unsigned int p;
+
+	if (!sep) {
+		*prio = DEFAULT_PRIO;
+		return kstrtoint(tok, 0, val);
+	}
+
+	*sep = '\0';
+	if (kstrtouint(tok, 0, &p) || p >= PRODCONS_NR_PRIOS)
+		return -EINVAL;
+	*prio = p;
+	return kstrtoint(sep + 1, 0, val);
+}
+
+/*
+ * Parse the whitespace separated items in kbuf[0..len) (NUL terminated).
+ * vals[i] and prios[i] get the i-th item and ends[i] the offset right after
+ * it. Parsing stops at the first invalid token, whose offset is stored in
+ * *stop (len if the whole buffer was parsed). Returns the number of items.
+ */
+static int parse_items(char *kbuf, size_t len, int *vals, u8 *prios,
+		       size_t *ends, size_t *stop)
+{
+	size_t pos = 0, tok;
+	int nr_items = 0;
+
+	for (;;) {
+		while (pos < len && isspace(kbuf[pos]))
+			pos++;
+		if (pos == len)
+			break;
+		tok = pos;
+		while (pos < len && !isspace(kbuf[pos]))
+			pos++;
+		kbuf[pos] = '\0';
+		if (parse_item(&kbuf[tok], &vals[nr_items], &prios[nr_items])) {
+			pos = tok;
+			break;
+		}
+		ends[nr_items++] = pos;
+	}
+
+	*stop = pos;
+	return nr_items;
+}
+
+/*
+ * How a read or write may block: not at all (O_NONBLOCK) or until an
+ * optional deadline, taken from the per-file timeouts when it starts.
+ */
+struct op_wait {
+	bool nonblock;
+	bool timed;
+	unsigned long deadline;	/* jiffies */
+};
+
+static void op_wait_init(struct op_wait *w, struct file *filp, unsigned int timeout_ms)
+{
+	w->nonblock = filp->f_flags & O_NONBLOCK;
+	w->timed = timeout_ms != 0;
+	w->deadline = jiffies + msecs_to_jiffies(timeout_ms);
+}
+
+/*
+ * Jiffies the caller may sleep next, at most slice: -EAGAIN for
+ * non-blocking callers and -ETIMEDOUT once the deadline has passed.
+ */
+static long wait_slice(struct op_wait *w, long slice)
+{
+	long left;
+
+	if (w->nonblock)
+		return -EAGAIN;
+	if (!w->timed)
+		return slice;
+	left = (long)(w->deadline - jiffies);
+	if (left <= 0)
+		return -ETIMEDOUT;
+	return min(slice, left);
+}
+
+/*
+ * Double the spin budget of q after a hit and halve it after a miss, so
+ * that queues whose waits are long soon stop burning CPU. Updates may
+ * race with each other, which only makes the heuristic less precise.
+ */
+static void spin_adapt(struct prodcons_queue *q, bool hit)
+{
+	unsigned int max = READ_ONCE(q->spin_max_ns);
+	unsigned int cur = READ_ONCE(q->spin_ns);
+
+	if (hit)
+		cur = cur > max / 2 ? max : cur * 2;
+	else
+		cur = cur / 2 < max / 16 ? max / 16 : cur / 2;
+	WRITE_ONCE(q->spin_ns, cur);
+}
+
+/*
+ * Busy-wait for cond during the spin budget of q, giving up early if
+ * another task needs the CPU or a signal arrives. Evaluates to whether
+ * cond became true. Pointless with a single CPU: nobody else would
+ * make it true.
+ */
+#define spin_until(q, cond)						\
+({									\
+	unsigned int __budget = READ_ONCE((q)->spin_ns);		\
+	u64 __end = ktime_get_ns() + __budget;				\
+	bool __hit = false;						\
+									\
+	if (__budget && num_online_cpus() > 1) {			\
+		while (!need_resched() && !signal_pending(current)) {	\
+			if (cond) {					\
+				__hit = true;				\
+				break;					\
+			}						\
+			if (ktime_get_ns() >= __end)			\
+				break;					\
+			cpu_relax();					\
+		}							\
+		spin_adapt(q, __hit);					\
+	}								\
+	__hit;								\
+})
+
+/*
+ * Wait until the consumer watermark is reached (or the timeout expires),
+ * spinning for a while before going to sleep. Non-blocking callers get
+ * -EAGAIN and callers past their deadline -ETIMEDOUT instead.
+ */
+static int wait_for_items(struct prodcons_queue *q, struct op_wait *w)
+{
+	long slice = wait_slice(w, wake_timeout(watermark(q, wake_items)));
+	u64 start;
+
+	if (slice < 0)
+		return slice;
+	if (spin_until(q, cbuf_items(q) >= watermark(q, wake_items)))
+		return 0;
+	start = ktime_get_ns();
+	slice = wait_exclusive_timeout(q->consumers,
+			cbuf_items(q) >= watermark(q, wake_items), slice);
+	stat_blocked(q, false, start, slice < 0);
+	return slice < 0 ? -EINTR : 0;
+}
+
+/* Same as wait_for_items() for producers */
+static int wait_for_slots(struct prodcons_queue *q, struct op_wait *w)
+{
+	long slice = wait_slice(w, wake_timeout(watermark(q, wake_slots)));
+	u64 start;
+
+	if (slice < 0)
+		return slice;
+	if (spin_until(q, cbuf_slots(q) >= watermark(q, wake_slots)))
+		return 0;
+	start = ktime_get_ns();
+	slice = wait_exclusive_timeout(q->producers,
+			cbuf_slots(q) >= watermark(q, wake_slots), slice);
+	stat_blocked(q, true, start, slice < 0);
+	return slice < 0 ? -EINTR : 0;
+}
+
+/*
+ * Enqueue up to n items. When the queue is full the overflow policy says
+ * whether to block (only while none of them fits), discard items or fail.
+ * Returns the number of items consumed, enqueued or dropped.
+ */
+static int cbuf_put(struct prodcons_queue *q, const int *vals, const u8 *prios,
+		    unsigned int n, struct op_wait *w)
+{
+	unsigned int done = 0, enqueued = 0, in, dropped;
+	bool overwrite = q->overflow == OVERFLOW_DROP_OLDEST &&
+			 (q->mode == PRODCONS_MODE_FIFO || q->mode == PRODCONS_MODE_PRIO);
+	int ret;
+
+	for (;;) {
+		if (overwrite) {
+			in = queue_in_overwrite(q, vals + done, prios ? prios + done : NULL,
+						n - done, &dropped);
+			atomic_long_add(dropped, &q->dropped);
+		} else
+			in = queue_in(q, vals + done, prios ? prios + done : NULL, n - done);
+		enqueued += in;
+		done += in;
+		if (done == n || (done > 0 && q->overflow == OVERFLOW_BLOCK))
+			break;
+		if (q->overflow == OVERFLOW_DROP_NEWEST) {
+			atomic_long_add(n - done, &q->dropped);
+			done = n;
+			break;
+		}
+		/* More items than capacity: make room for the rest */
+		if (overwrite && in > 0)
+			continue;
+		if (q->overflow == OVERFLOW_DROP_OLDEST && q->mode == PRODCONS_MODE_PERCPU &&
+		    (dropped = queue_drop(q, n - done))) {
+			atomic_long_add(dropped, &q->dropped);
+			continue;
+		}
+		if (done > 0)
+			break;
+		if (q->overflow == OVERFLOW_FAIL_FAST)
+			return -ENOBUFS;
+		if ((ret = wait_for_slots(q, w)))
+			return ret;
+	}
+
+	this_cpu_add(q->stats->enqueued, enqueued);
+	wake_consumer(q);
+	wake_producer(q);
+
+	return done;
+}
+
+/* Dequeue up to n items, blocking while the buffer is empty */
+static int cbuf_get(struct prodcons_queue *q, struct prodcons_item *items, unsigned int n,
+		    struct op_wait *w)
+{
+	unsigned int done, i;
+	u64 now;
+	int ret;
+
+	while ((done = queue_out(q, items, n)) == 0) {
+		if ((ret = wait_for_items(q, w)))
+			return ret;
+	}
+
+	now = ktime_get_ns();
+	for (i = 0; i < done; i++)
+		dwell_add(q, &items[i], now);
+
+	wake_producer(q);
+	wake_consumer(q);
+
+	return done;
+}
+
+/*
+ * Binary formats: records are moved as raw ints (struct prodcons_prio_rec
+ * when writing to a prio queue, struct prodcons_ts_rec when reading with
+ * PRODCONS_FMT_BINARY_TS). kfifo_to_user/from_user may fault and sleep, so
+ * they cannot run under the queue lock; records are bounced through a
+ * kernel buffer of at most MAX_CHUNK bytes instead.
+ */
+static ssize_t read_binary(struct prodcons_queue *q, struct iov_iter *to,
+			   int format, struct op_wait *w)
+{
+	size_t rec = format == PRODCONS_FMT_BINARY_TS ? sizeof(struct prodcons_ts_rec) : sizeof(int);
+	size_t len = iov_iter_count(to);
+	size_t pos = 0, n = (len > MAX_CHUNK ? MAX_CHUNK : len) / rec;
+	struct prodcons_item *items;
+	char *kbuf;
+	ssize_t ret;
+	int done, i;
+
+	if (n == 0)
+		return -EINVAL;
+	items = kmalloc_array(n, sizeof(*items), GFP_KERNEL);
+	kbuf = kmalloc(n * rec, GFP_KERNEL);
+	if (!items || !kbuf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if ((ret = done = cbuf_get(q, items, n, w)) <= 0)
+		goto out;
+	for (i = 0; i < done; i++)
+		put_item(&items[i], format, kbuf, n * rec, &pos);
+	ret = pos;
+	if (copy_to_iter(kbuf, ret, to) != ret)
+		ret = -EFAULT;
+out:
+	kfree(kbuf);
+	kfree(items);
+	return ret;
+}
+
+static ssize_t write_binary_prio(struct prodcons_queue *q, struct iov_iter *from,
+				 struct op_wait *w)
+{
+	size_t len = iov_iter_count(from);
+	size_t i, n = (len > MAX_CHUNK ? MAX_CHUNK : len) / sizeof(struct prodcons_prio_rec);
+	struct prodcons_prio_rec *recs;
+	int *vals;
+	u8 *prios;
+	ssize_t ret;
+
+	if (n == 0)
+		return -EINVAL;
+	recs = kmalloc_array(n, sizeof(*recs), GFP_KERNEL);
+	vals = kmalloc_array(n, sizeof(int), GFP_KERNEL);
+	prios = kmalloc(n, GFP_KERNEL);
+	if (!recs || !vals || !prios) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_iter(recs, n * sizeof(*recs), from) != n * sizeof(*recs)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	/* Records after an invalid priority are left for the next write */
+	for (i = 0; i < n && recs[i].prio >= 0 && recs[i].prio < PRODCONS_NR_PRIOS; i++) {
+		vals[i] = recs[i].value;
+		prios[i] = recs[i].prio;
+	}
+	if (i == 0) {
+		this_cpu_inc(q->stats->parse_rejects);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if ((ret = cbuf_put(q, vals, prios, i, w)) > 0)
+		ret *= sizeof(*recs);
+out:
+	kfree(prios);
+	kfree(vals);
+	kfree(recs);
+	return ret;
+}
+
+static ssize_t write_binary(struct prodcons_queue *q, struct iov_iter *from, struct op_wait *w)
+{
+	size_t len = iov_iter_count(from);
+	size_t n = (len > MAX_CHUNK ? MAX_CHUNK : len) / sizeof(int);
+	int *vals;
+	ssize_t ret;
+
+	if (q->mode == PRODCONS_MODE_PRIO)
+		return write_binary_prio(q, from, w);
+
+	if (n == 0)
+		return -EINVAL;
+	if ((vals = kmalloc_array(n, sizeof(int), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	if (copy_from_iter(vals, n * sizeof(int), from) != n * sizeof(int))
+		ret = -EFAULT;
+	else if ((ret = cbuf_put(q, vals, NULL, n, w)) > 0)
+		ret *= sizeof(int);
+
+	kfree(vals);
+	return ret;
+}
+
+/*
+ * Message mode: a write enqueues exactly one message and a read dequeues
+ * exactly one, whatever the format of the file. Payloads are bounced
+ * through a kernel buffer since the queue lock is a spinlock.
+ */
+static ssize_t msg_read(struct prodcons_queue *q, struct iov_iter *to, struct op_wait *w)
+{
+	size_t len = iov_iter_count(to);
+	struct prodcons_item it;
+	unsigned int msg_len;
+	char *kbuf;
+	ssize_t ret;
+
+	if ((kbuf = kmalloc(min_t(size_t, len, q->msg_max) + sizeof(u64), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	for (;;) {
+		spin_lock(&q->lock);
+		if (!kfifo_is_empty(&q->msgs)) {
+			msg_len = kfifo_peek_len(&q->msgs);
+			if (msg_len - sizeof(u64) > len) {
+				ret = -EMSGSIZE;
+			} else {
+				ret = kfifo_out(&q->msgs, kbuf, msg_len) - sizeof(u64);
+				q->msg_count--;
+			}
+			spin_unlock(&q->lock);
+			break;
+		}
+		spin_unlock(&q->lock);
+
+		if ((ret = wait_for_items(q, w)))
+			goto out;
+	}
+	if (ret < 0)
+		goto out;
+
+	/* Any amount of free space may be what a blocked writer needs */
+	wake_up_interruptible(&q->producers);
+	wake_consumer(q);
+
+	memcpy(&it.ts, kbuf, sizeof(u64));
+	dwell_add(q, &it, ktime_get_ns());
+	if (copy_to_iter(kbuf + sizeof(u64), ret, to) != ret)
+		ret = -EFAULT;
+out:
+	kfree(kbuf);
+	return ret;
+}
+
+/*
+ * Discard the oldest messages until a record of len bytes fits (drop-oldest
+ * policy). Called with q->lock held right before inserting it, so messages
+ * are only dropped while the queue is really full.
+ */
+static unsigned int msg_drop(struct prodcons_queue *q, unsigned int len)
+{
+	unsigned int dropped = 0;
+
+	while (kfifo_avail(&q->msgs) < len && !kfifo_is_empty(&q->msgs)) {
+		kfifo_skip(&q->msgs);
+		q->msg_count--;
+		dropped++;
+	}
+
+	return dropped;
+}
+
+static ssize_t msg_write(struct prodcons_queue *q, struct iov_iter *from, struct op_wait *w)
+{
+	size_t len = iov_iter_count(from);
+	unsigned int done;
+	unsigned int dropped = 0;
+	char *kbuf;
+	ssize_t ret = len;
+	long slice;
+	u64 now, start;
+
+	if (len > q->msg_max)
+		return -EMSGSIZE;
+	if ((kbuf = kmalloc(len + sizeof(u64), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	if (copy_from_iter(kbuf + sizeof(u64), len, from) != len) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for (;;) {
+		/* Every message starts with its enqueue time */
+		now = ktime_get_ns();
+		memcpy(kbuf, &now, sizeof(u64));
+		spin_lock(&q->lock);
+		if (q->overflow == OVERFLOW_DROP_OLDEST)
+			dropped = msg_drop(q, len + sizeof(u64));
+		/* A record fifo only accepts whole records */
+		if ((done = kfifo_in(&q->msgs, kbuf, len + sizeof(u64))) == len + sizeof(u64)) {
+			q->msg_count++;
+			if (q->msg_count > q->high_water)
+				q->high_water = q->msg_count;
+		}
+		spin_unlock(&q->lock);
+
+		if (dropped)
+			atomic_long_add(dropped, &q->dropped);
+		if (done == len + sizeof(u64)) {
+			this_cpu_inc(q->stats->enqueued);
+			break;
+		}
+		if (q->overflow == OVERFLOW_DROP_NEWEST) {
+			atomic_long_inc(&q->dropped);
+			break;
+		}
+		if (q->overflow == OVERFLOW_FAIL_FAST) {
+			ret = -ENOBUFS;
+			goto out;
+		}
+		if ((slice = wait_slice(w, MAX_SCHEDULE_TIMEOUT)) < 0) {
+			ret = slice;
+			goto out;
+		}
+		start = ktime_get_ns();
+		slice = wait_exclusive_timeout(q->producers,
+				kfifo_avail(&q->msgs) >= len + sizeof(u64), slice);
+		stat_blocked(q, true, start, slice < 0);
+		if (slice < 0) {
+			ret = -EINTR;
+			goto out;
+		}
+	}
+
+	wake_consumer(q);
+	if (!kfifo_is_full(&q->msgs))
+		wake_up_interruptible(&q->producers);
+out:
+	kfree(kbuf);
+	return ret;
+}
+
+/*
+ * Bcast mode: the items are left in the queue for the other readers, only
+ * the cursor of this file moves. Both formats are handled here.
+ */
+static ssize_t bcast_read(struct prodcons_file *pf, struct iov_iter *to, struct op_wait *w)
+{
+	struct prodcons_queue *q = pf->q;
+	size_t len = iov_iter_count(to);
+	char *kbuf;
+	ssize_t ret;
+	long slice;
+	u64 start;
+
+	if (!pf->bcast_reader)
+		bcast_join(q, pf);
+
+	if (len > MAX_CHUNK)
+		len = MAX_CHUNK;
+	if ((kbuf = kmalloc(len, GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	while ((ret = bcast_out(q, &pf->rd, kbuf, len, pf->format)) == 0) {
+		if ((slice = wait_slice(w, wake_timeout(watermark(q, wake_items)))) < 0) {
+			ret = slice;
+			goto out;
+		}
+		start = ktime_get_ns();
+		/* Not exclusive: every reader gets the same items */
+		slice = wait_event_interruptible_timeout(q->consumers,
+				bcast_pending(q, &pf->rd) >= watermark(q, wake_items), slice);
+		stat_blocked(q, false, start, slice < 0);
+		if (slice < 0) {
+			ret = -EINTR;
+			goto out;
+		}
+	}
+	if (ret < 0)
+		goto out;
+
+	wake_producer(q);
+
+	if (copy_to_iter(kbuf, ret, to) != ret)
+		ret = -EFAULT;
+out:
+	kfree(kbuf);
+	return ret;
+}
+
+/*
+ * Same as op_wait_init() for read_iter/write_iter: IOCB_NOWAIT (io_uring,
+ * preadv2(RWF_NOWAIT)) is handled like O_NONBLOCK.
+ */
+static void iocb_wait_init(struct op_wait *w, struct kiocb *iocb, unsigned int timeout_ms)
+{
+	op_wait_init(w, iocb->ki_filp, timeout_ms);
+#ifdef IOCB_NOWAIT
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		w->nonblock = true;
+#endif
+}
+
+/* A task waiting for its turn in a fair queue */
+struct fair_waiter {
+	struct list_head list;
+	struct task_struct *task;
+	u64 start;
+};
+
+/*
+ * Fair queues serve blocked readers (writers) in arrival order: each task
+ * joins the line of its side and only the first one in the line may use
+ * the queue, so late comers cannot overtake those that were sleeping.
+ * Every task is woken up by the one before it (an exclusive wakeup), and
+ * only the first one sleeps on q->consumers (q->producers).
+ */
+static int fair_enter(struct prodcons_queue *q, struct list_head *line,
+		      struct fair_waiter *fw, struct op_wait *w)
+{
+	long slice;
+	int ret = 0;
+
+	fw->task = current;
+	fw->start = ktime_get_ns();
+
+	spin_lock(&q->lock);
+	if (w->nonblock && !list_empty(line)) {
+		spin_unlock(&q->lock);
+		return -EAGAIN;
+	}
+	list_add_tail(&fw->list, line);
+	while (list_first_entry(line, struct fair_waiter, list) != fw) {
+		if ((slice = wait_slice(w, MAX_SCHEDULE_TIMEOUT)) < 0) {
+			ret = slice;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		/* Set before unlocking, so that fair_leave() cannot be missed */
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_unlock(&q->lock);
+		schedule_timeout(slice);
+		spin_lock(&q->lock);
+	}
+	/* Not the first one, so nobody has to be woken up */
+	if (ret)
+		list_del(&fw->list);
+	spin_unlock(&q->lock);
+
+	return ret;
+}
+
+/* Pass the turn to the next task in line and account the wait of fw */
+static void fair_leave(struct prodcons_queue *q, struct list_head *line,
+		       struct fair_waiter *fw, struct prodcons_wait_hist *hist)
+{
+	u64 waited = ktime_get_ns() - fw->start;
+	int b = fls64(waited);
+
+	spin_lock(&q->lock);
+	list_del(&fw->list);
+	if (!list_empty(line))
+		wake_up_process(list_first_entry(line, struct fair_waiter, list)->task);
+
+	hist->ops++;
+	hist->total_ns += waited;
+	if (waited > hist->max_ns)
+		hist->max_ns = waited;
+	hist->hist[min(b, PRODCONS_WAIT_BUCKETS - 1)]++;
+	spin_unlock(&q->lock);
+}
+
+/*
+ * Drain as many items as fit in the user buffers, which may be scattered
+ * (readv(), io_uring): records are split among them.
+ */
+static ssize_t queue_read(struct prodcons_file *pf, struct iov_iter *to, struct op_wait *w)
+{
+	struct prodcons_queue *q = pf->q;
+	size_t len = iov_iter_count(to);
+	char *kbuf;
+	int nr_bytes;
+
+	if (q->mode == PRODCONS_MODE_MSG)
+		return msg_read(q, to, w);
+	if (q->mode == PRODCONS_MODE_BCAST)
+		return bcast_read(pf, to, w);
+	if (pf->format != PRODCONS_FMT_TEXT)
+		return read_binary(q, to, pf->format, w);
+
+	if (len > MAX_CHUNK)
+		len = MAX_CHUNK;
+
+	if ((kbuf = kmalloc(len, GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	while ((nr_bytes = cbuf_format(q, kbuf, len)) == 0) {
+		if ((nr_bytes = wait_for_items(q, w)))
+			goto out;
+	}
+	if (nr_bytes < 0)
+		goto out;
+
+	wake_producer(q);
+	wake_consumer(q);
+
+	if (copy_to_iter(kbuf, nr_bytes, to) != nr_bytes)
+		nr_bytes = -EFAULT;
+out:
+	kfree(kbuf);
+	return nr_bytes;
+}
+
+/*
+ * Called when a process, which already opened the dev file, attempts to
+ * read from it. Readers of a fair queue wait for their turn first, except
+ * in bcast mode, where each one has its own items.
+ */
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct prodcons_file *pf = iocb->ki_filp->private_data;
+	struct prodcons_queue *q = pf->q;
+	struct fair_waiter fw;
+	struct op_wait w;
+	ssize_t ret;
+
+	if (iov_iter_count(to) == 0)
+		return 0;
+
+	iocb_wait_init(&w, iocb, pf->read_timeout_ms);
+	if (!q->fair || q->mode == PRODCONS_MODE_BCAST)
+		return queue_read(pf, to, &w);
+
+	if ((ret = fair_enter(q, &q->fair_readers, &fw, &w)))
+		return ret;
+	ret = queue_read(pf, to, &w);
+	fair_leave(q, &q->fair_readers, &fw, &pf->read_waits);
+
+	return ret;
+}
+
+/*
+ * Enqueue the items written: echo "1 2 3" > /dev/prodcons0
+ *
+ * The integers are enqueued as a batch. Each one may carry a priority
+ * ("prio:value"), only used by prio queues. If the buffer fills up after
+ * some of them were accepted, the write returns the number of bytes
+ * consumed so far (partial write) instead of blocking. The data may come
+ * from several user buffers (writev(), io_uring).
+ */
+static ssize_t queue_write(struct prodcons_file *pf, struct iov_iter *from, struct op_wait *w)
+{
+	struct prodcons_queue *q = pf->q;
+	size_t len = iov_iter_count(from);
+	size_t chunk = len > MAX_CHUNK ? MAX_CHUNK : len;
+	char *kbuf;
+	int *vals;
+	u8 *prios;
+	size_t *ends, stop;
+	int nr_items, done;
+	ssize_t nr_bytes;
+
+	if (q->mode == PRODCONS_MODE_MSG)
+		return msg_write(q, from, w);
+
+	/* Timestamps are always taken by the kernel */
+	if (pf->format != PRODCONS_FMT_TEXT)
+		return write_binary(q, from, w);
+
+	kbuf = kmalloc(chunk + 1, GFP_KERNEL);
+	vals = kmalloc_array(chunk / 2 + 1, sizeof(int), GFP_KERNEL);
+	prios = kmalloc(chunk / 2 + 1, GFP_KERNEL);
+	ends = kmalloc_array(chunk / 2 + 1, sizeof(size_t), GFP_KERNEL);
+	if (!kbuf || !vals || !prios || !ends) {
+		nr_bytes = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_iter(kbuf, chunk, from) != chunk) {
+		nr_bytes = -EFAULT;
+		goto out;
+	}
+	kbuf[chunk] = '\0';
+
+	/* Do not parse a number split by the chunk boundary */
+	if (chunk < len) {
+		while (chunk > 0 && !isspace(kbuf[chunk - 1]))
+			chunk--;
+		if (chunk == 0) {
+			this_cpu_inc(q->stats->parse_rejects);
+			nr_bytes = -EINVAL;
+			goto out;
+		}
+	}
+
+	nr_items = parse_items(kbuf, chunk, vals, prios, ends, &stop);
+	if (nr_items == 0) {
+		/* Only blanks before the (invalid) token: consume them */
+		if (!stop)
+			this_cpu_inc(q->stats->parse_rejects);
+		nr_bytes = stop ? stop : -EINVAL;
+		goto out;
+	}
+
+	if ((done = cbuf_put(q, vals, prios, nr_items, w)) < 0) {
+		nr_bytes = done;
+		goto out;
+	}
+
+	/* Everything parsed was accepted: swallow trailing blanks as well */
+	nr_bytes = (done == nr_items) ? stop : ends[done - 1];
+out:
+	kfree(ends);
+	kfree(prios);
+	kfree(vals);
+	kfree(kbuf);
+	return nr_bytes;
+}
+
+/* Called when a process writes to dev file. Same as device_read_iter(). */
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct prodcons_file *pf = iocb->ki_filp->private_data;
+	struct prodcons_queue *q = pf->q;
+	struct fair_waiter fw;
+	struct op_wait w;
+	ssize_t ret;
+
+	if (iov_iter_count(from) == 0)
+		return 0;
+
+	iocb_wait_init(&w, iocb, pf->write_timeout_ms);
+	if (!q->fair)
+		return queue_write(pf, from, &w);
+
+	if ((ret = fair_enter(q, &q->fair_writers, &fw, &w)))
+		return ret;
+	ret = queue_write(pf, from, &w);
+	fair_leave(q, &q->fair_writers, &fw, &pf->write_waits);
+
+	return ret;
+}
+
+static bool ring_has_items(struct prodcons_queue *q)
+{
+	return READ_ONCE(q->ring->head) != READ_ONCE(q->ring->tail);
+}
+
+static bool ring_has_slots(struct prodcons_queue *q)
+{
+	return READ_ONCE(q->ring->head) - READ_ONCE(q->ring->tail) <= q->ring_mask;
+}
+
+/*
+ * Ask user space for a PRODCONS_RING_WAKE. The barrier orders the flag
+ * store before the following check of head/tail, pairing with the barrier
+ * user space issues between publishing an index and reading the flags.
+ */
+static void ring_arm(struct prodcons_queue *q, u32 flags)
+{
+	spin_lock(&q->ring_lock);
+	WRITE_ONCE(q->ring->flags, q->ring->flags | flags);
+	spin_unlock(&q->ring_lock);
+	smp_mb();
+}
+
+/* Futex-like wait: sleep until cond() holds, a signal arrives or w expires */
+static int ring_wait(struct prodcons_queue *q, wait_queue_head_t *wq, u32 flag,
+		     bool (*cond)(struct prodcons_queue *), struct op_wait *w)
+{
+	DEFINE_WAIT(wait);
+	long slice;
+	int ret = 0;
+
+	for (;;) {
+		prepare_to_wait(wq, &wait, TASK_INTERRUPTIBLE);
+		ring_arm(q, flag);
+		if (cond(q))
+			break;
+		if ((slice = wait_slice(w, MAX_SCHEDULE_TIMEOUT)) < 0) {
+			ret = slice;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		schedule_timeout(slice);
+	}
+	finish_wait(wq, &wait);
+
+	return ret;
+}
+
+static void ring_wake(struct prodcons_queue *q)
+{
+	u32 flags;
+
+	spin_lock(&q->ring_lock);
+	flags = q->ring->flags;
+	WRITE_ONCE(q->ring->flags, 0);
+	spin_unlock(&q->ring_lock);
+
+	if (flags & PRODCONS_RING_WAKE_CONSUMERS)
+		wake_up_interruptible(&q->ring_consumers);
+	if (flags & PRODCONS_RING_WAKE_PRODUCERS)
+		wake_up_interruptible(&q->ring_producers);
+}
+
+/*
+ * Move the contents of q->cbuf to a new kfifo of (at least) n items.
+ * Fails with -EBUSY if the queued items would not fit.
+ */
+static int cbuf_resize(struct prodcons_queue *q, unsigned int n)
+{
+	struct item_kfifo nbuf;
+	struct prodcons_item it;
+	int ret;
+
+	/* The sub-queues of a percpu queue cannot be frozen all at once */
+	if (q->mode != PRODCONS_MODE_FIFO)
+		return -EOPNOTSUPP;
+
+	if ((ret = fifo_alloc(&nbuf, n, q->node)))
+		return ret;
+
+	spin_lock(&q->lock);
+	if (kfifo_len(&q->cbuf) > kfifo_size(&nbuf)) {
+		spin_unlock(&q->lock);
+		kfifo_free(&nbuf);
+		return -EBUSY;
+	}
+	while (kfifo_get(&q->cbuf, &it))
+		kfifo_put(&nbuf, it);
+	swap(q->cbuf, nbuf);
+	spin_unlock(&q->lock);
+
+	kfifo_free(&nbuf);
+
+	/* Tasks sleeping on the old fifo have to re-evaluate the new one */
+	wake_up_interruptible_all(&q->producers);
+	wake_up_interruptible_all(&q->consumers);
+
+	return 0;
+}
+
+static long device_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct prodcons_file *pf = filp->private_data;
+	struct prodcons_queue *q = pf->q;
+	int __user *uarg = (int __user *)arg;
+	struct prodcons_info info;
+	struct prodcons_timeouts timeouts;
+	struct prodcons_wait_stats *waits;
+	struct op_wait w;
+	u64 overruns;
+	unsigned int n;
+	long ret;
+	int val;
+
+	switch (cmd) {
+	case PRODCONS_SET_FORMAT:
+		if (get_user(val, uarg))
+			return -EFAULT;
+		if (val != PRODCONS_FMT_TEXT && val != PRODCONS_FMT_BINARY &&
+		    val != PRODCONS_FMT_BINARY_TS)
+			return -EINVAL;
+		pf->format = val;
+		return 0;
+	case PRODCONS_GET_FORMAT:
+		return put_user(pf->format, uarg);
+	case PRODCONS_SET_CAPACITY:
+		if (get_user(n, (unsigned int __user *)arg))
+			return -EFAULT;
+		return cbuf_resize(q, n);
+	case PRODCONS_GET_INFO:
+		spin_lock(&q->lock);
+		info.capacity = cbuf_size(q);
+		info.items = cbuf_items(q);
+		info.high_water = q->high_water;
+		info.mode = q->mode;
+		spin_unlock(&q->lock);
+		if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+			return -EFAULT;
+		return 0;
+	case PRODCONS_SET_TIMEOUTS:
+		if (copy_from_user(&timeouts, (void __user *)arg, sizeof(timeouts)))
+			return -EFAULT;
+		pf->read_timeout_ms = timeouts.read_ms;
+		pf->write_timeout_ms = timeouts.write_ms;
+		return 0;
+	case PRODCONS_GET_TIMEOUTS:
+		timeouts.read_ms = pf->read_timeout_ms;
+		timeouts.write_ms = pf->write_timeout_ms;
+		if (copy_to_user((void __user *)arg, &timeouts, sizeof(timeouts)))
+			return -EFAULT;
+		return 0;
+	case PRODCONS_GET_OVERRUNS:
+		spin_lock(&q->lock);
+		overruns = pf->rd.overruns;
+		spin_unlock(&q->lock);
+		return put_user(overruns, (u64 __user *)arg);
+	case PRODCONS_GET_DROPPED:
+		return put_user((u64)atomic_long_read(&q->dropped), (u64 __user *)arg);
+	case PRODCONS_GET_WAIT_STATS:
+		if ((waits = kmalloc(sizeof(*waits), GFP_KERNEL)) == NULL)
+			return -ENOMEM;
+		spin_lock(&q->lock);
+		waits->read = pf->read_waits;
+		waits->write = pf->write_waits;
+		spin_unlock(&q->lock);
+		ret = copy_to_user((void __user *)arg, waits, sizeof(*waits)) ? -EFAULT : 0;
+		kfree(waits);
+		return ret;
+	case PRODCONS_RING_WAIT_ITEMS:
+		op_wait_init(&w, filp, pf->read_timeout_ms);
+		return ring_wait(q, &q->ring_consumers, PRODCONS_RING_WAKE_CONSUMERS,
+				ring_has_items, &w);
+	case PRODCONS_RING_WAIT_SLOTS:
+		op_wait_init(&w, filp, pf->write_timeout_ms);
+		return ring_wait(q, &q->ring_producers, PRODCONS_RING_WAKE_PRODUCERS,
+				ring_has_slots, &w);
+	case PRODCONS_RING_WAKE:
+		ring_wake(q);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Same as device_poll() for files used to mmap the shared ring */
+static unsigned int ring_poll(struct file *filp, struct prodcons_queue *q, poll_table *wait)
+{
+	unsigned long events = poll_requested_events(wait);
+	unsigned int mask = 0;
+
+	poll_wait(filp, &q->ring_consumers, wait);
+	poll_wait(filp, &q->ring_producers, wait);
+
+	ring_arm(q, (events & POLLIN ? PRODCONS_RING_WAKE_CONSUMERS : 0) |
+		 (events & POLLOUT ? PRODCONS_RING_WAKE_PRODUCERS : 0));
+
+	if (ring_has_items(q))
+		mask |= POLLIN | POLLRDNORM;
+	if (ring_has_slots(q))
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+/*
+ * Readable while there are queued items, writable while there are free
+ * slots. Pollers sleep on the same wait queues as blocked readers/writers,
+ * so they are woken with the same wake_items/wake_slots watermarks.
+ */
+static unsigned int device_poll(struct file *filp, poll_table *wait)
+{
+	struct prodcons_file *pf = filp->private_data;
+	struct prodcons_queue *q = pf->q;
+	unsigned int mask = 0;
+
+	if (pf->ring_mapped)
+		return ring_poll(filp, q, wait);
+
+	/* An O_RDWR bcast descriptor waiting for items is a reader as well */
+	if (q->mode == PRODCONS_MODE_BCAST && !pf->bcast_reader &&
+	    (filp->f_mode & FMODE_READ) && (poll_requested_events(wait) & POLLIN))
+		bcast_join(q, pf);
+
+	poll_wait(filp, &q->consumers, wait);
+	poll_wait(filp, &q->producers, wait);
+
+	if (q->mode == PRODCONS_MODE_BCAST) {
+		if (pf->bcast_reader && bcast_pending(q, &pf->rd) > 0)
+			mask |= POLLIN | POLLRDNORM;
+	} else if (cbuf_items(q) > 0)
+		mask |= POLLIN | POLLRDNORM;
+	if (cbuf_slots(q) > 0)
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+/*
+ * Map the shared ring: the header page followed by the slots. The pages
+ * come from vmalloc_user(), so they are already zeroed.
+ */
+static int device_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct prodcons_file *pf = filp->private_data;
+	int ret;
+
+	/* A private copy of the header would hide head/tail from the kernel */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	if ((ret = remap_vmalloc_range(vma, pf->q->ring, vma->vm_pgoff)))
+		return ret;
+
+	pf->ring_mapped = true;
+	return 0;
 }
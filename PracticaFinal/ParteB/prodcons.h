@@ -0,0 +1,206 @@
+/*
+ * Interface of the prodcons device shared by the kernel module and the
+ * user programs (ioctl numbers and record formats).
+ */
+#ifndef PRODCONS_H
+#define PRODCONS_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define PRODCONS_IOC_MAGIC 'p'
+
+/* Per-descriptor record formats */
+#define PRODCONS_FMT_TEXT	0	/* One "%i\n" line per item (default) */
+#define PRODCONS_FMT_BINARY	1	/* Raw native-endian int32 records */
+#define PRODCONS_FMT_BINARY_TS	2	/* struct prodcons_ts_rec on read */
+
+/*
+ * Item and the time it was enqueued (CLOCK_MONOTONIC, ns), comparable with
+ * clock_gettime() to measure end to end latencies. Writes in this format
+ * take raw int32 records, as in PRODCONS_FMT_BINARY.
+ */
+struct prodcons_ts_rec {
+	__s32 value;
+	__u32 pad;
+	__u64 ts_ns;
+};
+
+#define PRODCONS_SET_FORMAT	_IOW(PRODCONS_IOC_MAGIC, 1, int)
+#define PRODCONS_GET_FORMAT	_IOR(PRODCONS_IOC_MAGIC, 2, int)
+
+/*
+ * Queue modes, chosen per queue with the modes= module parameter.
+ * In percpu mode producers and consumers work on the sub-queue of their
+ * CPU and consumers steal from the others when theirs is empty, so items
+ * are no longer delivered in global FIFO order.
+ *
+ * In prio mode every item carries a priority, 0 being the most urgent,
+ * and reads return the most urgent items first (FIFO within a level).
+ * Text writes use "prio:value" tokens (a plain value gets the lowest
+ * priority) and binary writes struct prodcons_prio_rec records; reads
+ * return only the values.
+ *
+ * In msg mode the queue carries arbitrary byte messages (up to 64 KiB - 9)
+ * instead of integers: each write enqueues one message, each read
+ * dequeues one (EMSGSIZE if it does not fit in the buffer), and the
+ * capacity, given by the msg_bytes module parameter, is in bytes.
+ *
+ * In bcast mode every descriptor opened for reading gets every item
+ * written after it was opened (O_RDONLY) or after its first read or poll
+ * for POLLIN (O_RDWR, so that a descriptor which only writes is never
+ * waited for). Beware that an O_RDWR descriptor that read once and then
+ * only writes throttles its own writes as any other reader. A lagging
+ * reader blocks the writers, or with the bcast_drop module parameter
+ * loses its oldest items, which are counted as overruns
+ * (PRODCONS_GET_OVERRUNS). Items in GET_INFO are those not yet read by
+ * the slowest reader.
+ */
+#define PRODCONS_MODE_FIFO	0
+#define PRODCONS_MODE_PERCPU	1
+#define PRODCONS_MODE_PRIO	2
+#define PRODCONS_MODE_MSG	3
+#define PRODCONS_MODE_BCAST	4
+
+#define PRODCONS_NR_PRIOS	8
+
+struct prodcons_prio_rec {
+	__s32 prio;
+	__s32 value;
+};
+
+/*
+ * Resize the queue (rounded up to a power of two) keeping its contents.
+ * Only supported in fifo mode.
+ */
+#define PRODCONS_SET_CAPACITY	_IOW(PRODCONS_IOC_MAGIC, 3, unsigned int)
+
+struct prodcons_info {
+	__u32 capacity;		/* Size of the queue in items (bytes for msg) */
+	__u32 items;		/* Items (messages) currently queued */
+	__u32 high_water;	/* Max number of items ever queued */
+	__u32 mode;		/* PRODCONS_MODE_* */
+};
+
+#define PRODCONS_GET_INFO	_IOR(PRODCONS_IOC_MAGIC, 4, struct prodcons_info)
+
+/*
+ * Shared ring (mmap of the device). The first page holds this header and
+ * the int32 slots start at data_offset. head and tail are free running
+ * indices: the ring is empty when head == tail and full when
+ * head - tail == mask + 1. There can be one producer process (owner of
+ * head) and one consumer process (owner of tail) at a time.
+ *
+ * The kernel only takes part in blocking: a task that finds the ring empty
+ * (full) calls PRODCONS_RING_WAIT_ITEMS (_SLOTS), or polls the descriptor
+ * used for mmap. Before sleeping the kernel sets PRODCONS_RING_WAKE_CONSUMERS
+ * (_PRODUCERS) in flags, so after publishing head (tail) and a full memory
+ * barrier the other side must call PRODCONS_RING_WAKE if the flag is set.
+ */
+struct prodcons_ring {
+	__u32 head;		/* Next slot to fill (producer) */
+	__u32 pad0[15];
+	__u32 tail;		/* Next slot to consume (consumer) */
+	__u32 pad1[15];
+	__u32 mask;		/* Number of slots - 1 */
+	__u32 data_offset;	/* Offset of the slots within the mapping */
+	__u32 flags;		/* PRODCONS_RING_WAKE_* (written by the kernel) */
+};
+
+#define PRODCONS_RING_WAKE_CONSUMERS	0x1
+#define PRODCONS_RING_WAKE_PRODUCERS	0x2
+
+#define PRODCONS_RING_WAIT_ITEMS	_IO(PRODCONS_IOC_MAGIC, 5)
+#define PRODCONS_RING_WAIT_SLOTS	_IO(PRODCONS_IOC_MAGIC, 6)
+#define PRODCONS_RING_WAKE		_IO(PRODCONS_IOC_MAGIC, 7)
+
+/*
+ * Max time (ms, 0 = no limit) a read (write) through this descriptor may
+ * block before failing with ETIMEDOUT. The ring waits use them as well.
+ * Opens start with the read_timeout_ms and write_timeout_ms module params.
+ */
+struct prodcons_timeouts {
+	__u32 read_ms;
+	__u32 write_ms;
+};
+
+#define PRODCONS_SET_TIMEOUTS	_IOW(PRODCONS_IOC_MAGIC, 8, struct prodcons_timeouts)
+#define PRODCONS_GET_TIMEOUTS	_IOR(PRODCONS_IOC_MAGIC, 9, struct prodcons_timeouts)
+
+/* Items this descriptor lost in a bcast queue (0 in the other modes) */
+#define PRODCONS_GET_OVERRUNS	_IOR(PRODCONS_IOC_MAGIC, 10, __u64)
+
+/*
+ * Items (messages) discarded by the overflow policy of the queue, chosen
+ * with the overflow= module parameter: block (default), drop-newest (the
+ * write succeeds but the items that did not fit are lost), drop-oldest
+ * (queued items are lost to make room) or fail-fast (the write fails with
+ * ENOBUFS instead of sleeping).
+ */
+#define PRODCONS_GET_DROPPED	_IOR(PRODCONS_IOC_MAGIC, 11, __u64)
+
+/*
+ * In queues loaded with fair=1 blocked readers and writers are served in
+ * arrival order. Each descriptor keeps the distribution of the time its
+ * reads (writes) took in such a queue, waits for the turn included.
+ */
+#define PRODCONS_WAIT_BUCKETS	32
+
+struct prodcons_wait_hist {
+	__u64 ops;
+	__u64 total_ns;
+	__u64 max_ns;
+	__u64 hist[PRODCONS_WAIT_BUCKETS];	/* [b]: ops of [2^(b-1), 2^b) ns, last one longer */
+};
+
+struct prodcons_wait_stats {
+	struct prodcons_wait_hist read;
+	struct prodcons_wait_hist write;
+};
+
+#define PRODCONS_GET_WAIT_STATS	_IOR(PRODCONS_IOC_MAGIC, 12, struct prodcons_wait_stats)
+
+#ifndef __KERNEL__
+#include <sys/ioctl.h>
+
+static inline __s32 *prodcons_ring_data(struct prodcons_ring *ring)
+{
+	return (__s32 *)((char *)ring + ring->data_offset);
+}
+
+/* Enqueue val, sleeping in the kernel while the ring is full */
+static inline int prodcons_ring_push(int fd, struct prodcons_ring *ring, __s32 val)
+{
+	__u32 head = ring->head;
+
+	while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask)
+		if (ioctl(fd, PRODCONS_RING_WAIT_SLOTS) < 0)
+			return -1;
+
+	prodcons_ring_data(ring)[head & ring->mask] = val;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->flags, __ATOMIC_RELAXED) & PRODCONS_RING_WAKE_CONSUMERS)
+		return ioctl(fd, PRODCONS_RING_WAKE);
+	return 0;
+}
+
+/* Dequeue into *val, sleeping in the kernel while the ring is empty */
+static inline int prodcons_ring_pop(int fd, struct prodcons_ring *ring, __s32 *val)
+{
+	__u32 tail = ring->tail;
+
+	while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+		if (ioctl(fd, PRODCONS_RING_WAIT_ITEMS) < 0)
+			return -1;
+
+	*val = prodcons_ring_data(ring)[tail & ring->mask];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->flags, __ATOMIC_RELAXED) & PRODCONS_RING_WAKE_PRODUCERS)
+		return ioctl(fd, PRODCONS_RING_WAKE);
+	return 0;
+}
+#endif
+
+#endif
@@ -1,81 +1,419 @@
+/*
+ * Benchmark for the prodcons driver.
+ *
+ * Producers write stamped integers to the queue and consumers read them
+ * back, measuring the throughput, the latency of each item (from the
+ * write call to the read that returned it) and the context switches per
+ * item. Every item carries its send time in units of 100 ns (31 bits, so
+ * latencies up to ~200 s are measured right).
+ *
+ *   gcc -O2 -Wall -pthread -o user user.c
+ *   ./user -p 4 -c 4 -n 1000000 -b 64 -f binary -j
+ */
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include "prodcons.h"
 
-int fd;
+#define TICK_NS 100
+#define STAMP_MASK 0x7fffffff
+#define IDLE_MS 200	/* Consumers give up this long after the producers end */
+#define MAX_CPUS 1024
 
-void *pruebaProdCons(void *arg){
-	int i;
-	int num = *((int*) arg);
-	int r;
-	char *c = malloc(4);
-	char *s = malloc(4);
+struct thread {
+	pthread_t tid;
+	int id;
+	int fd;
+	uint64_t items;		/* Items written / read */
+	uint64_t retries;	/* EAGAIN (non-blocking) or ETIMEDOUT */
+	uint64_t *lat;		/* Latencies (ns) of the items read */
+	uint64_t nr_lat, max_lat;
+	uint64_t last;		/* When it read its last item */
+};
 
-	if(num == 1){
-		for(i = 0;i < 5; i++){
-			sprintf(c, "%i", i); 
-			if(write(fd, c, strlen(c)) < 0)
-				perror("write: ");
-		}
-		sleep(3);
-		while(1){
-			r = rand() % 11;
-			sprintf(c, "%i", r);
-			write(fd, c, strlen(c));
-			sleep(1);
-		}
+/* Options */
+static const char *device = "/dev/prodcons0";
+static int nr_producers = 1, nr_consumers = 1;
+static uint64_t nr_items = 100000;	/* Per producer */
+static int batch = 1;
+static bool binary, nonblock, json;
+static int cpus[MAX_CPUS], nr_cpus;
+
+static int mode;	/* PRODCONS_MODE_* of the queue */
+static uint64_t expected;	/* Items each consumer waits for (all of them together unless bcast) */
+static uint64_t consumed;	/* Items read by all the consumers */
+static volatile bool producers_done;
+static pthread_barrier_t barrier;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int stamp(void)
+{
+	return (now_ns() / TICK_NS) & STAMP_MASK;
+}
+
+static uint64_t latency(int val)
+{
+	return (((now_ns() / TICK_NS) - val) & STAMP_MASK) * TICK_NS;
+}
+
+static void pin(int k)
+{
+	cpu_set_t set;
+
+	if (nr_cpus == 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpus[k % nr_cpus], &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		fprintf(stderr, "cannot pin thread %d to CPU %d\n", k, cpus[k % nr_cpus]);
+}
+
+static int open_queue(int flags)
+{
+	int fd = open(device, flags | (nonblock ? O_NONBLOCK : 0));
+	int fmt = binary ? PRODCONS_FMT_BINARY : PRODCONS_FMT_TEXT;
+	/* Blocked consumers wake up now and then to see if the run is over */
+	struct prodcons_timeouts timeouts = { .read_ms = IDLE_MS, .write_ms = 0 };
+
+	if (fd < 0) {
+		perror(device);
+		exit(1);
 	}
-	else if(num == 2){
-		memset(s, 0, 4);
-		sleep(1);
-		for(i = 0; i < 5; i++){
-			read(fd, s, 3);
-			printf("%s", s);
-		}
-		while(1){
-			read(fd, s, 3);
-			printf("%s", s);
-			sleep(3);
-		}
+	if (ioctl(fd, PRODCONS_SET_FORMAT, &fmt) < 0 ||
+	    ioctl(fd, PRODCONS_SET_TIMEOUTS, &timeouts) < 0) {
+		perror("ioctl");
+		exit(1);
 	}
-	else {
-		while(1){
-			write(fd, "patata", sizeof(char)*6);
-			sleep(3);
+	return fd;
+}
+
+/* Write buf[0..len), retrying partial writes */
+static void write_all(struct thread *t, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(t->fd, buf, len)) < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				t->retries++;
+				continue;
+			}
+			perror("write");
+			exit(1);
 		}
+		buf += n;
+		len -= n;
 	}
+}
+
+/* Bytes of a written item: prio queues take struct prodcons_prio_rec in binary */
+static size_t write_size(void)
+{
+	if (!binary)
+		return 12;
+	return mode == PRODCONS_MODE_PRIO ? sizeof(struct prodcons_prio_rec) : sizeof(int);
+}
+
+static void *producer(void *arg)
+{
+	struct thread *t = arg;
+	size_t size = batch * write_size();
+	char *buf = malloc(size);
+	uint64_t i;
+	size_t len;
+	int j;
+
+	pin(t->id);
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < nr_items; i += j) {
+		len = 0;
+		for (j = 0; j < batch && i + j < nr_items; j++) {
+			if (binary && mode == PRODCONS_MODE_PRIO) {
+				struct prodcons_prio_rec *rec = (struct prodcons_prio_rec *)buf + j;
 
-	pthread_exit(0);
+				/* The default priority of text writes */
+				rec->prio = PRODCONS_NR_PRIOS - 1;
+				rec->value = stamp();
+				len += sizeof(*rec);
+			} else if (binary) {
+				((int *)buf)[j] = stamp();
+				len += sizeof(int);
+			} else
+				len += sprintf(buf + len, "%d ", stamp());
+		}
+		write_all(t, buf, len);
+	}
+	t->items = nr_items;
 
+	free(buf);
 	return NULL;
 }
 
-int main(void){
-	pthread_t th[3];
-	int num;
-	int arg[3];
+static void record(struct thread *t, int val)
+{
+	if (t->nr_lat < t->max_lat)
+		t->lat[t->nr_lat++] = latency(val);
+	t->items++;
+}
 
-	fd = open("/dev/prodcons", O_RDWR);
+/* Account the items of buf[0..len). Returns how many there were. */
+static int consume(struct thread *t, char *buf, ssize_t len)
+{
+	char *p, *end;
+	int n = 0;
 
+	if (binary) {
+		for (n = 0; n < len / (ssize_t)sizeof(int); n++)
+			record(t, ((int *)buf)[n]);
+		return n;
+	}
 
-	if(fd < 0)
-		printf("No se pudo abrir\n");
+	buf[len] = '\0';
+	for (p = buf; ; p = end, n++) {
+		long val = strtol(p, &end, 10);
 
-	for(num = 0; num < 3; num++){
-		arg[num] = num;
-		pthread_create(&th[num], NULL, pruebaProdCons, (void*)&arg[num]);
+		if (end == p)
+			break;
+		record(t, val);
 	}
+	return n;
+}
 
-	write(fd, "10", 2);
+static bool finished(struct thread *t)
+{
+	if (mode == PRODCONS_MODE_BCAST)
+		return t->items >= expected;
+	return __atomic_load_n(&consumed, __ATOMIC_RELAXED) >= expected;
+}
+
+static void *consumer(void *arg)
+{
+	struct thread *t = arg;
+	size_t size = batch * (binary ? sizeof(int) : 12);
+	char *buf = malloc(size + 1);
+	uint64_t idle = 0;
+	ssize_t len;
+	int n;
 
-	pthread_join(th[0], NULL);
-	pthread_join(th[1], NULL);
-	pthread_join(th[2], NULL);
+	pin(nr_producers + t->id);
+	pthread_barrier_wait(&barrier);
 
+	while (!finished(t)) {
+		if ((len = read(t->fd, buf, size)) < 0) {
+			if (errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR) {
+				perror("read");
+				exit(1);
+			}
+			t->retries++;
+			/* Items dropped by the overflow policy never arrive */
+			if (!producers_done)
+				idle = 0;
+			else if (!idle)
+				idle = now_ns();
+			else if (now_ns() - idle > IDLE_MS * 1000000ULL)
+				break;
+			continue;
+		}
+		idle = 0;
+		if ((n = consume(t, buf, len)) > 0)
+			t->last = now_ns();
+		__atomic_add_fetch(&consumed, n, __ATOMIC_RELAXED);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(uint64_t *lat, uint64_t n, double p)
+{
+	return n ? lat[(uint64_t)(p * (n - 1))] : 0;
+}
+
+static void parse_cpus(char *list)
+{
+	char *tok;
+
+	for (tok = strtok(list, ","); tok && nr_cpus < MAX_CPUS; tok = strtok(NULL, ","))
+		cpus[nr_cpus++] = atoi(tok);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-p producers] [-c consumers] [-n items] [-b batch]\n"
+		"          [-f text|binary] [-N] [-a cpu,cpu...] [-j]\n"
+		"  -n  items written by each producer (%llu)\n"
+		"  -b  items per write/read call (%d)\n"
+		"  -N  non-blocking I/O (spin on EAGAIN)\n"
+		"  -a  pin producers, then consumers, to these CPUs round robin\n"
+		"  -j  print the results as one JSON object\n",
+		prog, (unsigned long long)nr_items, batch);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	struct thread *th;
+	struct prodcons_info info;
+	struct rusage ru0, ru1;
+	uint64_t start, end = 0, elapsed, items = 0, retries = 0, nr_lat = 0, *lat;
+	long csw;
+	int i, opt, fd;
+	double rate;
+
+	while ((opt = getopt(argc, argv, "d:p:c:n:b:f:Na:j")) != -1) {
+		switch (opt) {
+		case 'd': device = optarg; break;
+		case 'p': nr_producers = atoi(optarg); break;
+		case 'c': nr_consumers = atoi(optarg); break;
+		case 'n': nr_items = strtoull(optarg, NULL, 0); break;
+		case 'b': batch = atoi(optarg); break;
+		case 'f':
+			if (!strcmp(optarg, "binary"))
+				binary = true;
+			else if (strcmp(optarg, "text")) {
+				fprintf(stderr, "unknown format %s\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 'N': nonblock = true; break;
+		case 'a': parse_cpus(optarg); break;
+		case 'j': json = true; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (nr_producers < 1 || nr_consumers < 1 || batch < 1 || nr_items == 0)
+		usage(argv[0]);
+
+	fd = open_queue(O_RDONLY);
+	if (ioctl(fd, PRODCONS_GET_INFO, &info) < 0) {
+		perror("PRODCONS_GET_INFO");
+		return 1;
+	}
 	close(fd);
+	mode = info.mode;
+	expected = nr_items * nr_producers;
+
+	th = calloc(nr_producers + nr_consumers, sizeof(*th));
+	pthread_barrier_init(&barrier, NULL, nr_producers + nr_consumers + 1);
+
+	/* Readers of a bcast queue must be there before the first write */
+	for (i = 0; i < nr_consumers; i++) {
+		struct thread *t = &th[nr_producers + i];
+
+		t->id = i;
+		t->fd = open_queue(O_RDONLY);
+		/*
+		 * Every consumer gets all the items in bcast mode, a share of
+		 * them otherwise (twice the fair one, the rest is not sampled)
+		 */
+		if (mode == PRODCONS_MODE_BCAST || nr_consumers == 1)
+			t->max_lat = expected;
+		else
+			t->max_lat = 2 * (expected / nr_consumers) + batch;
+		if ((t->lat = malloc(t->max_lat * sizeof(uint64_t))) == NULL) {
+			perror("malloc");
+			return 1;
+		}
+		pthread_create(&t->tid, NULL, consumer, t);
+	}
+	for (i = 0; i < nr_producers; i++) {
+		th[i].id = i;
+		th[i].fd = open_queue(O_WRONLY);
+		pthread_create(&th[i].tid, NULL, producer, &th[i]);
+	}
+
+	getrusage(RUSAGE_SELF, &ru0);
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+
+	for (i = 0; i < nr_producers; i++) {
+		pthread_join(th[i].tid, NULL);
+		retries += th[i].retries;
+	}
+	producers_done = true;
+	for (i = nr_producers; i < nr_producers + nr_consumers; i++) {
+		pthread_join(th[i].tid, NULL);
+		items += th[i].items;
+		retries += th[i].retries;
+		nr_lat += th[i].nr_lat;
+		if (th[i].last > end)
+			end = th[i].last;
+	}
+	getrusage(RUSAGE_SELF, &ru1);
+	/* Consumers that ran out of items idle for a while before leaving */
+	elapsed = (end > start ? end : now_ns()) - start;
+	if (nr_lat < items)
+		fprintf(stderr, "warning: latency of %llu items not sampled\n",
+			(unsigned long long)(items - nr_lat));
+
+	/* Merge the latencies of all the consumers */
+	lat = malloc((nr_lat ? nr_lat : 1) * sizeof(uint64_t));
+	for (nr_lat = 0, i = nr_producers; i < nr_producers + nr_consumers; i++) {
+		memcpy(lat + nr_lat, th[i].lat, th[i].nr_lat * sizeof(uint64_t));
+		nr_lat += th[i].nr_lat;
+		close(th[i].fd);
+	}
+	for (i = 0; i < nr_producers; i++)
+		close(th[i].fd);
+	qsort(lat, nr_lat, sizeof(uint64_t), cmp_u64);
+
+	csw = (ru1.ru_nvcsw - ru0.ru_nvcsw) + (ru1.ru_nivcsw - ru0.ru_nivcsw);
+	rate = items * 1e9 / elapsed;
+
+	if (json)
+		printf("{\"device\":\"%s\",\"mode\":%u,\"producers\":%d,\"consumers\":%d,"
+		       "\"items\":%llu,\"batch\":%d,\"format\":\"%s\",\"nonblock\":%s,"
+		       "\"pinned\":%s,\"elapsed_ns\":%llu,\"items_per_s\":%.0f,"
+		       "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+		       "\"ctx_switches_per_item\":%.4f,\"retries\":%llu}\n",
+		       device, info.mode, nr_producers, nr_consumers,
+		       (unsigned long long)items, batch, binary ? "binary" : "text",
+		       nonblock ? "true" : "false", nr_cpus ? "true" : "false",
+		       (unsigned long long)elapsed, rate,
+		       (unsigned long long)percentile(lat, nr_lat, 0.50),
+		       (unsigned long long)percentile(lat, nr_lat, 0.99),
+		       (unsigned long long)percentile(lat, nr_lat, 0.999),
+		       items ? (double)csw / items : 0.0, (unsigned long long)retries);
+	else {
+		printf("%d producers, %d consumers, %s, batch %d%s%s\n",
+		       nr_producers, nr_consumers, binary ? "binary" : "text", batch,
+		       nonblock ? ", non-blocking" : "", nr_cpus ? ", pinned" : "");
+		printf("items read:     %llu (%llu written)\n",
+		       (unsigned long long)items, (unsigned long long)expected);
+		printf("throughput:     %.0f items/s\n", rate);
+		printf("latency p50:    %llu ns\n", (unsigned long long)percentile(lat, nr_lat, 0.50));
+		printf("latency p99:    %llu ns\n", (unsigned long long)percentile(lat, nr_lat, 0.99));
+		printf("latency p99.9:  %llu ns\n", (unsigned long long)percentile(lat, nr_lat, 0.999));
+		printf("ctx switches:   %.4f per item\n", items ? (double)csw / items : 0.0);
+		printf("retries:        %llu\n", (unsigned long long)retries);
+	}
 
 	return 0;
 }